@@ -0,0 +1,110 @@
+/** \file firmware/freemcan_trace.h
+ * \brief Tracepoints of the freemcan kernel module
+ *
+ * \author Copyright (C) 2014 samplemaker
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ *
+ *  enable with
+ *  echo 1 > /sys/kernel/debug/tracing/events/freemcan/enable
+ *  and read /sys/kernel/debug/tracing/trace_pipe
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM freemcan
+
+#if !defined(FREEMCAN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define FREEMCAN_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/** one gpio interrupt */
+TRACE_EVENT(freemcan_pulse,
+
+  TP_PROTO(unsigned int channel),
+
+  TP_ARGS(channel),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, channel)
+  ),
+
+  TP_fast_assign(
+    __entry->channel = channel;
+  ),
+
+  TP_printk("channel=%u", __entry->channel)
+);
+
+/** one record put into the ring by the timebase */
+TRACE_EVENT(freemcan_sample,
+
+  TP_PROTO(u64 sequence, u32 accu_counts, s64 latency_ns, int overruns),
+
+  TP_ARGS(sequence, accu_counts, latency_ns, overruns),
+
+  TP_STRUCT__entry(
+    __field(u64, sequence)
+    __field(u32, accu_counts)
+    __field(s64, latency_ns)
+    __field(int, overruns)
+  ),
+
+  TP_fast_assign(
+    __entry->sequence = sequence;
+    __entry->accu_counts = accu_counts;
+    __entry->latency_ns = latency_ns;
+    __entry->overruns = overruns;
+  ),
+
+  TP_printk("sequence=%llu counts=%u latency_ns=%lld overruns=%d",
+            (unsigned long long)__entry->sequence, __entry->accu_counts,
+            (long long)__entry->latency_ns, __entry->overruns)
+);
+
+/** one read() of a reader */
+TRACE_EVENT(freemcan_read,
+
+  TP_PROTO(unsigned int format, size_t length, ssize_t ret, u32 fill),
+
+  TP_ARGS(format, length, ret, fill),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, format)
+    __field(size_t, length)
+    __field(ssize_t, ret)
+    __field(u32, fill)
+  ),
+
+  TP_fast_assign(
+    __entry->format = format;
+    __entry->length = length;
+    __entry->ret = ret;
+    __entry->fill = fill;
+  ),
+
+  TP_printk("format=%u length=%zu ret=%zd fill=%u",
+            __entry->format, __entry->length, __entry->ret, __entry->fill)
+);
+
+#endif
+
+/* the header is not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE freemcan_trace
+#include <trace/define_trace.h>
@@ -21,6 +21,8 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
 #include <linux/init.h>
@@ -35,10 +37,27 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
-#include <linux/kfifo.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/delay.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/random.h>
+#include <linux/seqlock.h>
+#include <linux/cpumask.h>
+#include <linux/jiffies.h>
+#include <linux/smp.h>
 #include <asm/uaccess.h>
 #include "common_defs.h"
 
+#define CREATE_TRACE_POINTS
+#include "freemcan_trace.h"
+
 
 // #define TEST_ON_X86
 
@@ -59,6 +78,177 @@
 #define GPIO_INTERRUPT_PIN 23
 #endif
 
+/** one counter input */
+typedef struct {
+  /** gpio pin and the assigned irq line */
+  int gpio;
+  int irq;
+  /** sum of pulse_counts already handed out in a record */
+  u32 folded_counts;
+  u32 folded_rejected;
+  /** time of the last accepted edge (dead time) */
+  u64 last_edge_ns;
+  /** time of the last pulse which is not yet part of a coincidence */
+  u64 last_pulse_ns;
+  /** time of the last pulse for the interval histogram (0 = none) */
+  u64 last_interval_ns;
+  /** inter-arrival time histogram. only the ISR of this channel
+      writes to it */
+  u32 interval_bins[INTERVAL_HIST_BINS];
+  /** interrupt storm protection (storm_rate_hz): edges within the
+      window which started at storm_window. in jiffies, which cost
+      nothing to read in the ISR */
+  unsigned long storm_window;
+  u32 storm_edges;
+  /** storms since the module was loaded (debugfs) */
+  u32 storms;
+  /** the irq line is masked. set by the ISR, cleared by the timebase */
+  int storm_masked;
+  unsigned long storm_masked_at;
+  unsigned long storm_unmasked_at;
+  /** hold off of the current storm, doubled if the storm comes back
+      right after the irq was enabled again */
+  unsigned long storm_holdoff;
+} channel_t;
+
+static channel_t channels[MAX_CHANNELS];
+static unsigned int n_channels = 1;
+
+/** interrupt occurence counters */
+/* one set per cpu, so that the cache line does not bounce between the
+   cpu taking the gpio irq and the cpu running the timebase. the
+   counters are free running and never reset, the timebase folds the
+   difference to the last sample into the next record. hence no pulse
+   gets lost while the counters of the other cpus are summed up */
+typedef struct {
+  u32 counts[MAX_CHANNELS];
+  /** gpio interrupts (debugfs). differs from counts in the benchmark */
+  u32 isr_calls[MAX_CHANNELS];
+  /** edges within the dead time */
+  u32 rejected[MAX_CHANNELS];
+} pulse_counts_t;
+
+static DEFINE_PER_CPU(pulse_counts_t, pulse_counts);
+
+#ifndef TEST_ON_X86
+/** counter inputs, one gpio pin per channel */
+static int gpio_pins[MAX_CHANNELS] = { GPIO_INTERRUPT_PIN };
+module_param_array(gpio_pins, int, &n_channels, S_IRUGO);
+MODULE_PARM_DESC(gpio_pins, "gpio pin of each counter input (max 4)");
+
+/** edge of the input signal which is counted. a pulse has two edges,
+    "both" counts every pulse twice */
+static char *trigger_edge = "rising";
+module_param(trigger_edge, charp, S_IRUGO);
+MODULE_PARM_DESC(trigger_edge, "counted edge: rising, falling or both");
+/** IRQF_TRIGGER_* of trigger_edge */
+static unsigned long trigger_flags = IRQF_TRIGGER_RISING;
+
+/** cpu which handles the pulse interrupts, -1 = leave it to the kernel */
+static int irq_cpu = -1;
+module_param(irq_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(irq_cpu, "affinity hint of the pulse interrupts (-1 = none)");
+#endif
+
+/** minimum time between two pulses of a channel in ns (0 = off).
+    shorter edges are ringing or glitches and are rejected. may be
+    changed at runtime */
+static unsigned long dead_time_ns = 0;
+module_param(dead_time_ns, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dead_time_ns, "software dead time of each channel in ns (0 = off)");
+
+#ifdef TEST_ON_X86
+/** number of simulated counter inputs */
+module_param_named(sim_channels, n_channels, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_channels, "number of simulated counter inputs (max 4)");
+
+/** pulse simulator. may be changed at runtime via
+    /sys/module/firmware_geiger_ts/parameters/ */
+static unsigned int sim_rate_hz = 100;
+module_param(sim_rate_hz, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_rate_hz, "mean rate of the simulated pulses in Hz (0 = off)");
+static unsigned int sim_burst_len = 1;
+module_param(sim_burst_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_burst_len, "simulated pulses come in bursts of this length (1 = poisson)");
+#define SIM_RATE_MAX (10 * 1000 * 1000)
+#define SIM_BURST_MAX 1000
+
+/** the simulator timer. pulses which are due are injected at least
+    this far apart, hence they are late by up to one tick */
+static struct hrtimer hrt_sim;
+static ktime_t kt_sim_next;
+#define SIM_TICK_NS_MIN (10 * NSEC_PER_USEC)
+/* timer interval while the simulator is off */
+#define SIM_IDLE_NS (10 * NSEC_PER_MSEC)
+/* the simulator does not catch up after a longer stall */
+#define SIM_LAG_NS_MAX NSEC_PER_SEC
+#endif
+
+/** pulses generated by the simulator since start */
+static atomic64_t sim_generated = ATOMIC64_INIT(0);
+/** pulses put into records since start */
+static atomic64_t recorded_counts = ATOMIC64_INIT(0);
+
+/** coincidence window in ns, 0 = off. may be changed at runtime via
+    /sys/module/firmware_geiger_ts/parameters/ */
+static unsigned long coincidence_window_ns = 0;
+module_param(coincidence_window_ns, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coincidence_window_ns, "coincidence window in ns (0 = off)");
+static atomic_t coincidence_counts = ATOMIC_INIT(0);
+
+/** inter-arrival time histogram on/off. costs a timestamp per pulse.
+    may be changed at runtime */
+static bool interval_histogram = 0;
+module_param(interval_histogram, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(interval_histogram, "histogram of the time between pulses (0 = off)");
+
+/** interrupt storm protection. a channel which sees more edges than
+    storm_rate_hz within storm_window_ms (a shorted or ringing input)
+    gets its irq masked. the timebase enables it again after
+    storm_holdoff_ms, the hold off doubles (up to STORM_HOLDOFF_MS_MAX)
+    while the storm goes on. records of the masked time are flagged */
+static unsigned int storm_rate_hz = 500000;
+module_param(storm_rate_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(storm_rate_hz, "edge rate which masks the irq of a channel (0 = off)");
+static unsigned int storm_window_ms = 10;
+module_param(storm_window_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(storm_window_ms, "window of the edge rate in ms");
+static unsigned int storm_holdoff_ms = 100;
+module_param(storm_holdoff_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(storm_holdoff_ms, "minimum time an irq stays masked in ms");
+#define STORM_HOLDOFF_MS_MAX (10 * MSEC_PER_SEC)
+/** edges per window which are still no storm, 0 = off */
+static u32 storm_limit;
+/** the module parameters in jiffies */
+static unsigned long storm_window_jiffies;
+static unsigned long storm_holdoff_jiffies;
+/** channels which were masked within the running sample (bits) */
+static unsigned long storm_saturated;
+/** the benchmark drives channel 0 faster than any storm on purpose */
+static int storm_bypass;
+
+/** serializes the ISRs of different channels (coincidence and event
+    ring). only taken if a timestamp per pulse is required */
+static DEFINE_RAW_SPINLOCK(pulse_lock);
+
+/** benchmark (IOCTL_RUN_BENCHMARK). a hrtimer injects pulses into
+    channel 0 */
+static struct hrtimer hrt_bench;
+static ktime_t kt_bench_start, kt_bench_tick;
+static u64 bench_rate, bench_duration_ns, bench_generated;
+static int bench_done;
+static DECLARE_WAIT_QUEUE_HEAD(wq_bench);
+/* the timer injects several pulses per event at high rates */
+#define BENCH_TICK_NS_MIN (10 * NSEC_PER_USEC)
+
+#ifndef TEST_ON_X86
+/** output pin which is wired to the input of channel 0. -1 = inject
+    the pulses in software into the counting path */
+static int bench_gpio = -1;
+module_param(bench_gpio, int, S_IRUGO);
+MODULE_PARM_DESC(bench_gpio, "gpio pin wired to channel 0 for the benchmark (-1 = software)");
+#endif
+
 /** character device related stuff */
 static dev_t device_number;
 static struct cdev *driver_object;
@@ -68,45 +258,181 @@ static struct device *the_device;
 /** high resolution timer for timebase */
 static struct hrtimer hrt_timebase;
 static ktime_t kt_period, kt_start;
+/** absolute clock in the records (IOCTL_SET_WALL_CLOCK) */
+static unsigned int wall_clock = WALL_CLOCK_OFF;
+/** wall clocks - monotonic clock at kt_start (IOCTL_GET_CLOCK_OFFSETS) */
+static ktime_t kt_start_real_offset, kt_start_tai_offset;
 /** timer event counter */
-static atomic_t timer_counts = ATOMIC_INIT(1);
+static atomic64_t timer_counts = ATOMIC64_INIT(1);
+/** cpu which runs the timebase, -1 = the cpu which starts the
+    measurement */
+static int timer_cpu = -1;
+module_param(timer_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(timer_cpu, "cpu which runs the timebase timer (-1 = any)");
+/** timer events missed because the callback came too late */
+static atomic64_t missed_timer_events = ATOMIC64_INIT(0);
+/** the running sample: when the counts were folded the last time and
+    the timer events missed since then. timer callback only */
+static ktime_t kt_gate_start;
+static u32 gate_missed_periods;
+/** protects the sample boundary (folded_counts, recorded_counts and
+    kt_gate_start) for IOCTL_GET_LIVE. serializes the producers of the
+    record ring, too (timer callback or preset count tasklet) */
+static DEFINE_SEQLOCK(gate_lock);
 
 static unsigned int timercnts_per_sample = 1;
 
-/** character device single open policy */
-static atomic_t dev_use_count = ATOMIC_INIT(-1);
-
-#ifndef TEST_ON_X86
-/** interrupt occurence counter */
-static atomic_t accu_counts = ATOMIC_INIT(0);
-#endif
-
-/** wait queue for blocking/nonblocking read */
-static DECLARE_WAIT_QUEUE_HEAD(wq_read);
-static atomic_t wup_flag = ATOMIC_INIT(0);
-#define UNSET_READABLE_FLAG ( atomic_set( &wup_flag, 0 ) )
-#define SET_READABLE_FLAG ( atomic_set( &wup_flag, 1 ) )
-#define READABLE_FLAG ( atomic_read( &wup_flag ) != 0 )
-
-/** number of characters in the character ring buffer */
-/* must be a power of 2. the maximum number of elements which
-   can be stored is FIFO_SIZE_BYTES/[sizeof(fifo_data_t)
-   + number of extra characters per line] */
-#define FIFO_SIZE_BYTES (1 << 8)
-
-static DECLARE_KFIFO(char_fifo, unsigned char, FIFO_SIZE_BYTES);
-
-/** payload data which is sent over the character device */
+/** preset count mode: a record every preset_counts pulses. the ISR
+    only stamps the boundary, the record is emitted by a tasklet. 0 =
+    preset time mode (IOCTL_SET_PRESET_COUNTS) */
+static unsigned int preset_counts = 0;
+/** pulses towards the next preset count record. a global atomic, the
+    price of this mode */
+static atomic_t preset_pulses = ATOMIC_INIT(0);
+/** number of preset count boundaries since start */
+static atomic64_t preset_sequence = ATOMIC64_INIT(0);
+/** the boundary of the last preset count record. boundaries which
+    come before the tasklet runs are merged into one record, the
+    sequence of the records has a gap then. tasklet only */
+static u64 preset_emitted_sequence;
+
+/** number of sample records in the ring buffer */
+/* rounded up to a power of 2. the ring buffer holds binary records
+   only, the text output is created in device_read(). the default
+   holds 4.5 hours of 1 second samples */
+static unsigned int ring_records = (1 << 14);
+module_param(ring_records, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_records, "size of the record ring buffer in records");
+#define RING_RECORDS_MIN (1 << 4)
+#define RING_RECORDS_MAX (1 << 22)
+
+/** record ring. one control page followed by the records. the whole
+    memory is shared read only with user space via mmap() */
+static void *ring_mem;
+static ring_ctrl_t *ring_ctrl;
+static sample_record_t *ring_data;
+/* the firmware keeps its own copy of the producer index */
+static u32 ring_capacity, ring_head;
+
+/** ring statistics (IOCTL_GET_FIFO_STATS) */
+static atomic64_t ring_written = ATOMIC64_INIT(0);
+
+/** per open file state. every reader has its own cursor over the
+    shared record ring */
 typedef struct {
-  int timer_counts;
-  int kernel_time;
-  int accu_counts;
-} fifo_data_t;
-
-#ifndef TEST_ON_X86
-/** holds the assigned irq line */
-static int gpio_irq_in_number;
-#endif
+  /** cursor page, mmap() offset 0. the cursor lives in a page which
+      is writable by user space, it has to be treated with care */
+  reader_ctrl_t *ctrl;
+  /** output format of read(). see enum OUTPUT_FORMATS */
+  unsigned int output_format;
+  /** records overwritten before this reader got them */
+  u64 lost;
+  /** maximum backlog seen at read() */
+  u32 fill_hwm;
+  /** serializes read() calls on the same file */
+  struct mutex lock;
+  /** wait queue for blocking read and poll */
+  wait_queue_head_t wq;
+  /** wake up at this number of queued records (IOCTL_SET_WAKEUP) */
+  u32 watermark;
+  /** or if the oldest queued record is older (0 = off) */
+  u64 max_latency_ns;
+  /** entry in the list of all readers */
+  struct list_head list;
+} reader_t;
+
+/** all open files. walked by the timer callback to wake up the
+    readers, hence a spinlock */
+static LIST_HEAD(readers);
+static DEFINE_SPINLOCK(readers_lock);
+
+/** the timebase is running. a stopped measurement flushes the records
+    below the watermark */
+static int timebase_running = 0;
+
+/** serializes the ioctls which start, stop or reconfigure the
+    measurement (and the benchmark) */
+static DEFINE_MUTEX(control_lock);
+/** the reader which started the running measurement. the others get
+    -EBUSY from those ioctls until it stops the measurement or closes
+    its file. NULL = anybody. control_lock held */
+static reader_t *control_owner;
+
+/* there is no readable flag. each reader is readable as soon as its
+   watermark or latency is reached */
+#define READABLE_FLAG(reader) ( reader_ready(reader, measurement_time_ns()) )
+
+/** maximum length of one text line including '\n' and the wall
+    clock column */
+#define TEXT_LINE_MAX 112
+
+/** event ring. the ISRs are the producers (serialized by pulse_lock),
+    IOCTL_READ_EVENTS is the single consumer. holds monotonic
+    timestamps in ns tagged with the channel */
+static u64 event_ring[EVENT_RING_SIZE];
+static u32 event_head, event_tail;
+/** keeps IOCTL_READ_EVENTS of different readers apart */
+static DEFINE_MUTEX(event_read_lock);
+/** per pulse timestamps on/off (IOCTL_SET_EVENT_MODE) */
+static int event_mode = 0;
+/** pulses which did not fit into the event ring */
+static atomic_t event_overflows = ATOMIC_INIT(0);
+
+/** burst capture (IOCTL_SET_CAPTURE). a rolling window of pulse
+    timestamps in the format of the event ring which is frozen when the
+    running sample exceeds capture_threshold counts */
+/* must be a power of 2 and hold CAPTURE_EVENTS_MAX */
+#define CAPTURE_RING_SIZE CAPTURE_EVENTS_MAX
+enum CAPTURE_STATES{
+  /* waiting for the threshold, the window rolls */
+  CAPTURE_ARMED = 0,
+  /* collecting the post trigger timestamps */
+  CAPTURE_TRIGGERED,
+  /* complete, waiting for IOCTL_READ_CAPTURE. the ISRs leave it alone */
+  CAPTURE_FROZEN
+};
+/** state and window written by the ISRs with pulse_lock held */
+static u64 capture_ring[CAPTURE_RING_SIZE];
+static u32 capture_head;
+/** capture_head when the trigger was armed (no older timestamps) */
+static u32 capture_arm_head;
+/** index of the triggering pulse */
+static u32 capture_trigger;
+static int capture_state = CAPTURE_ARMED;
+/** 0 = off. the config is changed with pulse_lock held */
+static u32 capture_threshold = 0;
+static u32 capture_pre, capture_post;
+/** counts of the running sample, reset by sample_emit(). counted only
+    if the capture is on and the measurement runs, hence IOCTL_SET_CAPTURE
+    starts with the counts of the running sample so far */
+static atomic_t capture_counts = ATOMIC_INIT(0);
+/** captures taken since IOCTL_SET_CAPTURE */
+static u64 capture_taken;
+/** keeps IOCTL_READ_CAPTURE of different readers apart */
+static DEFINE_MUTEX(capture_read_lock);
+
+/** statistics since the module was loaded, see
+    /sys/kernel/debug/freemcan/. the timer statistics are written by the
+    timer callback only */
+static struct dentry *debug_dir;
+static u64 debug_timer_calls;
+static u64 debug_timer_overruns;
+static u64 debug_wakeups;
+/** timer callback latency (actual - expected expiry). bin i holds
+    latencies below 2^i ns */
+#define LATENCY_HIST_BINS 32
+static u32 debug_latency_bins[LATENCY_HIST_BINS];
+static u64 debug_latency_max_ns;
+/** timer latency per cpu. shows where the timebase runs and how the
+    cpu serves it */
+typedef struct {
+  u64 timer_calls;
+  u64 latency_sum_ns;
+  u64 latency_max_ns;
+} cpu_stats_t;
+static DEFINE_PER_CPU(cpu_stats_t, cpu_stats);
+static atomic64_t debug_read_calls = ATOMIC64_INIT(0);
+static atomic64_t debug_read_bytes = ATOMIC64_INIT(0);
 
 /* prototypes */
 static enum hrtimer_restart timer_callback(struct hrtimer * unused);
@@ -115,6 +441,7 @@ static int device_release(struct inode *, struct file *);
 static ssize_t device_read(struct file *, char *, size_t, loff_t *);
 static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 static unsigned int device_poll (struct file *file, poll_table *wait);
+static int device_mmap(struct file *filp, struct vm_area_struct *vma);
 static int __init firmware_init(void);
 static void __exit firmware_exit(void);
 
@@ -125,10 +452,390 @@ static struct file_operations device_fops = {
   .unlocked_ioctl = device_ioctl,
   .open = device_open,
   .release = device_release,
-  .poll = device_poll
+  .poll = device_poll,
+  .mmap = device_mmap
 };
 
 
+/** Number of records in the ring not yet seen by a reader
+ *
+ * The indices are free running, the difference is the fill level.
+ * It exceeds the capacity if the reader was lapped by the producer.
+ */
+static inline u32
+ring_fill(reader_t *reader){
+  return ACCESS_ONCE(ring_head) - ACCESS_ONCE(reader->ctrl->tail);
+}
+
+
+/** Append one record to the ring
+ *
+ * Single producer at a time (gate_lock held). The producer never waits
+ * for a reader, the oldest record is overwritten if the ring is full.
+ */
+static void
+ring_put(const sample_record_t *record){
+  const u32 head = ring_head;
+
+  /* the index of the last record must be visible before the oldest
+     record is overwritten. readers check the index after the copy */
+  smp_wmb();
+  ring_data[head & (ring_capacity - 1)] = *record;
+  /* the record must be visible before the index is published */
+  smp_wmb();
+  ACCESS_ONCE(ring_head) = head + 1;
+  ACCESS_ONCE(ring_ctrl->head) = head + 1;
+
+  atomic64_inc(&ring_written);
+}
+
+
+/** Nanoseconds since the start of the measurement (time base of
+ *  the records) */
+static inline u64
+measurement_time_ns(void){
+  return ktime_to_ns(ktime_sub(ktime_get(), kt_start));
+}
+
+
+/** Does a reader have to be woken up?
+ *
+ * Ready if the watermark is reached, if the oldest queued record is
+ * older than the maximum latency or if the measurement is stopped.
+ * A lapped reader always reaches its watermark.
+ */
+static bool
+reader_ready(reader_t *reader, u64 now_ns){
+  const u32 fill = ring_fill(reader);
+
+  if (fill == 0)
+    return false;
+  if ((fill >= ACCESS_ONCE(reader->watermark)) ||
+      (!ACCESS_ONCE(timebase_running)))
+    return true;
+  const u64 max_latency_ns = ACCESS_ONCE(reader->max_latency_ns);
+  if (max_latency_ns == 0)
+    return false;
+  /* the oldest record is not overwritten, fill < watermark <= capacity */
+  const u32 tail = ACCESS_ONCE(reader->ctrl->tail);
+  return (now_ns - ring_data[tail & (ring_capacity - 1)].time_ns
+          >= max_latency_ns);
+}
+
+
+/** Wake up the readers which reached their watermark or latency
+ *
+ * Called by the timer callback at every timer event.
+ */
+static void
+readers_wake(u64 now_ns){
+  reader_t *reader;
+
+  /* the new head must be visible before the waiters are checked. the
+     waiters queue themselves before they check the condition */
+  smp_mb();
+  spin_lock(&readers_lock);
+  list_for_each_entry(reader, &readers, list){
+    if (waitqueue_active(&reader->wq) && reader_ready(reader, now_ns)){
+      wake_up_interruptible(&reader->wq);
+      debug_wakeups++;
+    }
+  }
+  spin_unlock(&readers_lock);
+}
+
+
+/** Wake up all readers (measurement stopped) */
+static void
+readers_wake_all(void){
+  reader_t *reader;
+  unsigned long flags;
+
+  spin_lock_irqsave(&readers_lock, flags);
+  list_for_each_entry(reader, &readers, list)
+    wake_up_interruptible_all(&reader->wq);
+  spin_unlock_irqrestore(&readers_lock, flags);
+}
+
+
+/** Get the cursor of a reader and the number of readable records
+ *
+ * If the reader was lapped by the producer the lost records are
+ * accounted and skipped. A corrupted cursor is clamped the same way so
+ * that the reader never runs beyond the ring.
+ */
+static inline u32
+ring_get_tail(reader_t *reader, u32 *fill){
+  const u32 head = ACCESS_ONCE(ring_head);
+  u32 tail = ACCESS_ONCE(reader->ctrl->tail);
+
+  /* read the index before the records */
+  smp_rmb();
+  *fill = head - tail;
+  if (*fill > ring_capacity){
+    reader->lost += *fill - ring_capacity;
+    tail = head - ring_capacity;
+    *fill = ring_capacity;
+  }
+  if (*fill > reader->fill_hwm)
+    reader->fill_hwm = *fill;
+  return tail;
+}
+
+
+/** Number of records from tail on which were (possibly) overwritten
+ *  while they were copied
+ *
+ * Record i is intact if head - i < capacity holds after the copy.
+ */
+static inline u32
+ring_overwritten(u32 tail){
+  /* finish reading the records before the index is read */
+  smp_rmb();
+  const s32 bad = (s32)(ACCESS_ONCE(ring_head) - ring_capacity + 1 - tail);
+  return (bad > 0) ? bad : 0;
+}
+
+
+/** Advance the cursor of a reader */
+static inline void
+ring_set_tail(reader_t *reader, u32 tail){
+  ACCESS_ONCE(reader->ctrl->tail) = tail;
+}
+
+
+/** Allocate the ring memory (zeroed) and set up the control page
+ *
+ * The memory must be mappable to user space, hence vmalloc_user()
+ * and not kfifo_alloc().
+ */
+static int
+ring_init(void){
+  /* the records of the ring would be misaligned otherwise */
+  BUILD_BUG_ON(sizeof(sample_record_t) % sizeof(u64));
+  ring_capacity = clamp_t(unsigned int, ring_records,
+                          RING_RECORDS_MIN, RING_RECORDS_MAX);
+  ring_capacity = roundup_pow_of_two(ring_capacity);
+  const size_t data_size = PAGE_ALIGN(ring_capacity * sizeof(sample_record_t));
+
+  ring_mem = vmalloc_user(PAGE_SIZE + data_size);
+  if (ring_mem == NULL)
+    return -ENOMEM;
+  ring_ctrl = ring_mem;
+  ring_data = ring_mem + PAGE_SIZE;
+  ring_ctrl->version = RING_VERSION;
+  ring_ctrl->record_size = sizeof(sample_record_t);
+  ring_ctrl->capacity = ring_capacity;
+  /* behind the cursor page and the control page */
+  ring_ctrl->data_offset = 2 * PAGE_SIZE;
+  ring_head = 0;
+  printk(KERN_INFO "freemcan: ring buffer holds %u records\n", ring_capacity);
+  return SUCCESS;
+}
+
+
+/** Get the ring statistics as seen by a reader */
+static void
+ring_get_stats(reader_t *reader, fifo_stats_t *stats){
+  stats->capacity = ring_capacity;
+  stats->fill = min_t(u32, ring_fill(reader), ring_capacity);
+  stats->fill_hwm = reader->fill_hwm;
+  stats->reserved = 0;
+  stats->records_written = atomic64_read(&ring_written);
+  stats->records_dropped = reader->lost;
+  stats->bytes_dropped = stats->records_dropped * sizeof(sample_record_t);
+}
+
+
+/** Restart the ring statistics */
+static void
+ring_reset_stats(void){
+  atomic64_set(&ring_written, 0);
+}
+
+
+static void
+ring_exit(void){
+  vfree(ring_mem);
+}
+
+
+/** Append a pulse timestamp to the event ring
+ *
+ * Called from the ISR with pulse_lock held. Keep it short, this runs
+ * once per pulse.
+ */
+static inline void
+event_put(u64 timestamp){
+  const u32 head = event_head;
+
+  if (head - ACCESS_ONCE(event_tail) >= EVENT_RING_SIZE){
+    atomic_inc(&event_overflows);
+    return;
+  }
+  event_ring[head & (EVENT_RING_SIZE - 1)] = timestamp;
+  /* the timestamp must be visible before the index is published */
+  smp_wmb();
+  ACCESS_ONCE(event_head) = head + 1;
+}
+
+
+/** Copy pulse timestamps relative to the start of the measurement
+ *  to user space and remove them from the event ring
+ *
+ * Returns the number of timestamps copied or -EFAULT
+ */
+static int
+event_read(u64 __user *buffer, u32 count){
+  /* converted in small chunks, the stack is tiny */
+  u64 chunk[32];
+  const u64 start_ns = ktime_to_ns(kt_start);
+  const u32 head = ACCESS_ONCE(event_head);
+  u32 tail = event_tail;
+  u32 copied = 0;
+
+  /* read the index before the timestamps */
+  smp_rmb();
+  while ((tail != head) && (copied < count)){
+    u32 n = 0;
+    while ((tail != head) && (copied + n < count) && (n < ARRAY_SIZE(chunk))){
+      const u64 event = event_ring[tail & (EVENT_RING_SIZE - 1)];
+      chunk[n++] = ((event & EVENT_TIME_MASK) - start_ns) | (event & ~EVENT_TIME_MASK);
+      tail++;
+    }
+    if (copy_to_user(buffer + copied, chunk, n * sizeof(u64)))
+      return -EFAULT;
+    copied += n;
+  }
+  /* finish reading before the slots are handed back to the ISR */
+  smp_mb();
+  ACCESS_ONCE(event_tail) = tail;
+  return copied;
+}
+
+
+/** Feed a pulse timestamp into the burst capture
+ *
+ * Called from the ISR with pulse_lock held if the capture is on.
+ */
+static inline void
+capture_put(u64 timestamp){
+  /* a stopped measurement has no running sample */
+  if ((capture_state == CAPTURE_FROZEN) || (!ACCESS_ONCE(timebase_running)))
+    return;
+  capture_ring[capture_head & (CAPTURE_RING_SIZE - 1)] = timestamp;
+  capture_head++;
+  if ((capture_state == CAPTURE_ARMED) &&
+      ((u32)atomic_inc_return(&capture_counts) > capture_threshold)){
+    capture_trigger = capture_head - 1;
+    capture_state = CAPTURE_TRIGGERED;
+  }
+  /* pre_events + post_events fit into the ring, the window before the
+     trigger is not overwritten */
+  if ((capture_state == CAPTURE_TRIGGERED) &&
+      (capture_head - capture_trigger >= capture_post)){
+    /* IOCTL_READ_CAPTURE reads the window without pulse_lock */
+    smp_wmb();
+    ACCESS_ONCE(capture_state) = CAPTURE_FROZEN;
+  }
+}
+
+
+/** Start over with an empty window. pulse_lock held
+ *
+ * The counts of the running sample are kept. If they exceed the
+ * threshold already the next pulse triggers.
+ */
+static inline void
+capture_arm(void){
+  capture_arm_head = capture_head;
+  capture_state = CAPTURE_ARMED;
+}
+
+
+/** Set the trigger and arm it (IOCTL_SET_CAPTURE)
+ *
+ * running_counts are the pulses of the running sample so far.
+ */
+static int
+capture_config(const capture_config_t *config, u32 running_counts){
+  unsigned long flags;
+
+  if (config->threshold &&
+      ((config->post_events == 0) ||
+       (config->pre_events > CAPTURE_EVENTS_MAX) ||
+       (config->post_events > CAPTURE_EVENTS_MAX - config->pre_events)))
+    return -EINVAL;
+  mutex_lock(&capture_read_lock);
+  raw_spin_lock_irqsave(&pulse_lock, flags);
+  capture_pre = config->pre_events;
+  capture_post = config->post_events;
+  capture_arm();
+  atomic_set(&capture_counts, ACCESS_ONCE(timebase_running) ? running_counts : 0);
+  ACCESS_ONCE(capture_threshold) = config->threshold;
+  raw_spin_unlock_irqrestore(&pulse_lock, flags);
+  capture_taken = 0;
+  mutex_unlock(&capture_read_lock);
+  return SUCCESS;
+}
+
+
+/** Copy a frozen capture relative to the start of the measurement to
+ *  user space and arm the trigger again
+ *
+ * arg->count is 0 if there is no capture yet. Returns SUCCESS or
+ * -EFAULT
+ */
+static int
+capture_read(capture_read_t *arg){
+  u64 chunk[32];
+  const u64 start_ns = ktime_to_ns(kt_start);
+  unsigned long flags;
+
+  if (ACCESS_ONCE(capture_state) != CAPTURE_FROZEN){
+    arg->count = 0;
+    arg->pre_events = 0;
+    arg->trigger_ns = 0;
+    arg->captures = capture_taken;
+    return SUCCESS;
+  }
+  /* frozen, the ISRs do not touch the window until it is armed again */
+  smp_rmb();
+  const u32 pre = min_t(u32, capture_pre, capture_trigger - capture_arm_head);
+  const u32 end = capture_head;
+  u32 first = capture_trigger - pre;
+  if (end - first > arg->count)
+    first = end - arg->count;
+  arg->count = end - first;
+  /* a small buffer may cut into the post trigger timestamps, too */
+  const s32 before = (s32)(capture_trigger - first);
+  arg->pre_events = (before > 0) ? before : 0;
+  const u64 trigger = capture_ring[capture_trigger & (CAPTURE_RING_SIZE - 1)];
+  arg->trigger_ns = (trigger & EVENT_TIME_MASK) - start_ns;
+
+  u64 __user *buffer = (u64 __user *)(uintptr_t)arg->buffer;
+  u32 i = first;
+  while (i != end){
+    u32 n = 0;
+    while ((i != end) && (n < ARRAY_SIZE(chunk))){
+      const u64 event = capture_ring[i & (CAPTURE_RING_SIZE - 1)];
+      chunk[n++] = ((event & EVENT_TIME_MASK) - start_ns) | (event & ~EVENT_TIME_MASK);
+      i++;
+    }
+    if (copy_to_user(buffer, chunk, n * sizeof(u64)))
+      return -EFAULT;
+    buffer += n;
+  }
+  capture_taken++;
+  arg->captures = capture_taken;
+
+  raw_spin_lock_irqsave(&pulse_lock, flags);
+  capture_arm();
+  raw_spin_unlock_irqrestore(&pulse_lock, flags);
+  return SUCCESS;
+}
+
+
 #ifndef TEST_ON_X86
 static inline
 void gpio_toggle(unsigned int gpio_number){
@@ -138,15 +845,647 @@ void gpio_toggle(unsigned int gpio_number){
 }
 
 
+#endif
+
+
+/** Check for a pulse on another channel within the coincidence window
+ *
+ * Called from the ISR with pulse_lock held. Each pulse takes part in
+ * one coincidence only.
+ */
+static inline void
+coincidence_check(channel_t *ch, u64 now, u64 window){
+  int i;
+
+  for (i = 0; i < n_channels; i++){
+    channel_t *other = &channels[i];
+    if ((other == ch) || (other->last_pulse_ns == 0))
+      continue;
+    /* the other ISR may have taken its timestamp after ours */
+    s64 delta = (s64)(now - other->last_pulse_ns);
+    if (delta < 0)
+      delta = -delta;
+    if (delta <= window){
+      other->last_pulse_ns = 0;
+      atomic_inc(&coincidence_counts);
+      return;
+    }
+  }
+  ch->last_pulse_ns = now;
+}
+
+
+/** Histogram bin of an interval in ns (see INTERVAL_HIST_BINS) */
+static inline unsigned int
+interval_bin(u64 delta){
+  if (delta < 4)
+    return delta;
+  /* octave and the two bits below the leading one */
+  const unsigned int msb = fls64(delta) - 1;
+  const unsigned int bin = 4 * (msb - 1) + ((delta >> (msb - 2)) & 3);
+  return min_t(unsigned int, bin, INTERVAL_HIST_BINS - 1);
+}
+
+
+/** Put the time since the last pulse into the histogram
+ *
+ * Called for the pulses of one channel one at a time, hence no lock:
+ * the irq line is not reentrant and the benchmark stops the line (or
+ * the simulator) while it injects pulses into channel 0.
+ */
+static inline void
+interval_put(channel_t *ch, u64 now){
+  const u64 last = ch->last_interval_ns;
+
+  ch->last_interval_ns = now;
+  if ((last == 0) || (now < last))
+    return;
+  ch->interval_bins[interval_bin(now - last)]++;
+}
+
+
+/** Clear the interval histogram of all channels
+ *
+ * Races with the ISRs cost a few entries at most.
+ */
+static void
+interval_reset(void){
+  int i;
+
+  for (i = 0; i < n_channels; i++){
+    channels[i].last_interval_ns = 0;
+    memset(channels[i].interval_bins, 0, sizeof(channels[i].interval_bins));
+  }
+}
+
+
+/** Copy the interval histogram to user space */
+static int
+interval_read(interval_hist_t __user *hist){
+  const u32 header[2] = { n_channels, 0 };
+  int i;
+
+  if (copy_to_user(hist, header, sizeof(header)))
+    return -EACCES;
+  /* straight from the channels, the histogram is too big for the
+     stack */
+  for (i = 0; i < MAX_CHANNELS; i++){
+    if (i < n_channels){
+      if (copy_to_user(hist->bins[i], channels[i].interval_bins,
+                       sizeof(hist->bins[i])))
+        return -EACCES;
+    } else if (clear_user(hist->bins[i], sizeof(hist->bins[i])))
+      return -EACCES;
+  }
+  return SUCCESS;
+}
+
+
+/** Count one pulse of a channel
+ *
+ * The timestamp (ns, 0 = not taken yet) is only taken if someone
+ * needs it.
+ */
+static inline void
+count_pulse(channel_t *ch, u64 now){
+  const u64 window = ACCESS_ONCE(coincidence_window_ns);
+  const int events = ACCESS_ONCE(event_mode);
+  const bool hist = ACCESS_ONCE(interval_histogram);
+  const u32 capture = ACCESS_ONCE(capture_threshold);
+
+  /* the irq line is disabled while its handler runs. other users
+     (benchmark) are not an irq but the increment is irq safe */
+  this_cpu_inc(pulse_counts.counts[ch - channels]);
+  if (window || events || hist || capture){
+    if (now == 0)
+      now = ktime_to_ns(ktime_get());
+    if (hist)
+      interval_put(ch, now);
+    if (window || events || capture){
+      const u64 event = now | ((u64)(ch - channels) << EVENT_CHANNEL_SHIFT);
+      raw_spin_lock(&pulse_lock);
+      if (window)
+        coincidence_check(ch, now, window);
+      if (events)
+        event_put(event);
+      if (capture)
+        capture_put(event);
+      raw_spin_unlock(&pulse_lock);
+    }
+  }
+}
+
+
+/** Total number of pulses of a channel counted by all cpus
+ *
+ * Free running, only differences are meaningful.
+ */
+static u32
+pulse_count_sum(unsigned int channel){
+  u32 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    sum += ACCESS_ONCE(per_cpu(pulse_counts, cpu).counts[channel]);
+  return sum;
+}
+
+
+/** Pulses of all channels within the running sample */
+static u32
+sample_counts(void){
+  unsigned int seq;
+  u32 counts;
+  int i;
+
+  do {
+    seq = read_seqbegin(&gate_lock);
+    counts = 0;
+    for (i = 0; i < n_channels; i++)
+      counts += pulse_count_sum(i) - channels[i].folded_counts;
+  } while (read_seqretry(&gate_lock, seq));
+  return counts;
+}
+
+
+/** Total number of rejected edges of a channel, see pulse_count_sum() */
+static u32
+rejected_sum(unsigned int channel){
+  u32 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    sum += ACCESS_ONCE(per_cpu(pulse_counts, cpu).rejected[channel]);
+  return sum;
+}
+
+
+/** Pulses of a channel since the last call
+ *
+ * Called by the timebase only. Pulses which are counted while the sum
+ * is built show up in the next sample. The rejected edges are folded
+ * the same way.
+ */
+static inline u32
+channel_fold(channel_t *ch, u32 *rejected){
+  const u32 total = pulse_count_sum(ch - channels);
+  const u32 counts = total - ch->folded_counts;
+  const u32 total_rejected = rejected_sum(ch - channels);
+
+  ch->folded_counts = total;
+  *rejected += total_rejected - ch->folded_rejected;
+  ch->folded_rejected = total_rejected;
+  return counts;
+}
+
+
+/** Timer callback function for the benchmark
+ *
+ * Injects as many pulses as are due at bench_rate since the start.
+ */
+static enum hrtimer_restart bench_callback(struct hrtimer * unused)
+{
+  const ktime_t kt_now = hrtimer_cb_get_time(&hrt_bench);
+  u64 elapsed_ns = ktime_to_ns(ktime_sub(kt_now, kt_bench_start));
+
+  if (elapsed_ns > bench_duration_ns)
+    elapsed_ns = bench_duration_ns;
+  /* no overflow within the limits of benchmark_t */
+  const u64 due = div_u64(bench_rate * elapsed_ns, NSEC_PER_SEC);
+  for (; bench_generated < due; bench_generated++){
+#ifndef TEST_ON_X86
+    if (bench_gpio >= 0){
+      /* one short pulse. edges which come faster than the irq is
+         handled are lost, that is what we want to see */
+      gpio_set_value(bench_gpio, 1);
+      gpio_set_value(bench_gpio, 0);
+      continue;
+    }
+#endif
+    count_pulse(&channels[0], 0);
+  }
+
+  if (elapsed_ns >= bench_duration_ns){
+    ACCESS_ONCE(bench_done) = 1;
+    wake_up_interruptible(&wq_bench);
+    return HRTIMER_NORESTART;
+  }
+  hrtimer_forward(&hrt_bench, kt_now, kt_bench_tick);
+  return HRTIMER_RESTART;
+}
+
+
+/** Inject pulses into channel 0 and count them
+ *
+ * Sleeps for the duration of the benchmark. Called with control_lock
+ * held and the measurement stopped.
+ */
+static int
+bench_run(benchmark_t *bench){
+  const u32 counts_before = pulse_count_sum(0);
+  int ret_val;
+
+  bench_rate = bench->rate_hz;
+  bench_duration_ns = bench->duration_ns;
+  bench_generated = 0;
+  bench_done = 0;
+  kt_bench_tick = ns_to_ktime(max_t(u64, div64_u64(NSEC_PER_SEC, bench_rate),
+                                    BENCH_TICK_NS_MIN));
+  /* the benchmark pulses are a storm by design */
+  ACCESS_ONCE(storm_bypass) = 1;
+  /* the injected pulses must not run next to the real ones of channel
+     0 on another cpu, see interval_put() */
+#ifndef TEST_ON_X86
+  if (bench_gpio < 0)
+    disable_irq(channels[0].irq);
+#else
+  hrtimer_cancel(&hrt_sim);
+#endif
+  kt_bench_start = ktime_get();
+  hrtimer_start(&hrt_bench, kt_bench_tick, HRTIMER_MODE_REL);
+  ret_val = wait_event_interruptible(wq_bench, ACCESS_ONCE(bench_done));
+  hrtimer_cancel(&hrt_bench);
+  ACCESS_ONCE(storm_bypass) = 0;
+#ifndef TEST_ON_X86
+  if (bench_gpio < 0)
+    enable_irq(channels[0].irq);
+#else
+  kt_sim_next = ktime_get();
+  hrtimer_start(&hrt_sim, kt_sim_next, HRTIMER_MODE_ABS);
+#endif
+  if (ret_val)
+    return -ERESTARTSYS;
+  /* give the last edges time to reach the handler */
+  msleep(10);
+
+  bench->generated = bench_generated;
+#ifndef TEST_ON_X86
+  /* the pulses on the wire have two edges */
+  if ((bench_gpio >= 0) &&
+      (trigger_flags == (IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING)))
+    bench->generated *= 2;
+#endif
+  bench->counted = pulse_count_sum(0) - counts_before;
+  return SUCCESS;
+}
+
+
+/** Close the running sample and put its record into the ring
+ *
+ * Called by the timer callback (preset time) or by the preset count
+ * tasklet. Folds the counts of all channels at kt_now.
+ */
+static void
+sample_emit(ktime_t kt_now, u64 sequence, s64 latency_ns, int overruns){
+  sample_record_t record;
+  int i;
+
+  record.version = RECORD_VERSION;
+  record.length = sizeof(sample_record_t);
+  record.sequence = sequence;
+
+  /* absolute time since start of measurement */
+  ktime_t kt_diff = ktime_sub(kt_now, kt_start);
+  record.time_ns = ktime_to_ns(kt_diff);
+
+  /* the wall clock at kt_now. the offset to the monotonic clock is
+     current, a step of the wall clock shows up in the next record */
+  record.wall_clock = ACCESS_ONCE(wall_clock);
+  record.wall_ns = 0;
+  if (record.wall_clock == WALL_CLOCK_REALTIME)
+    record.wall_ns = ktime_to_ns(ktime_add(kt_now,
+                                           ktime_sub(ktime_get_real(), ktime_get())));
+  else if (record.wall_clock == WALL_CLOCK_TAI)
+    record.wall_ns = ktime_to_ns(ktime_add(kt_now,
+                                           ktime_sub(ktime_get_clocktai(), ktime_get())));
+
+  /* the counting goes on meanwhile. pulses which are not part of the
+     sum show up in the next record */
+  record.channels = n_channels;
+  record.accu_counts = 0;
+  record.rejected_counts = 0;
+  write_seqlock(&gate_lock);
+  for (i = 0; i < MAX_CHANNELS; i++){
+    record.channel_counts[i] = (i < n_channels) ?
+      channel_fold(&channels[i], &record.rejected_counts) : 0;
+    record.accu_counts += record.channel_counts[i];
+  }
+  record.coincidence_counts = atomic_xchg(&coincidence_counts, 0);
+  /* masked now or at any time since the last record */
+  record.saturated_channels = xchg(&storm_saturated, 0);
+  for (i = 0; i < n_channels; i++)
+    if (ACCESS_ONCE(channels[i].storm_masked))
+      record.saturated_channels |= 1 << i;
+  atomic_set(&capture_counts, 0);
+  atomic64_add(record.accu_counts, &recorded_counts);
+
+  /* the counts were folded just now. this is the true gate edge, not
+     the nominal expiry */
+  record.gate_ns = ktime_to_ns(ktime_sub(kt_now, kt_gate_start));
+  record.missed_periods = gate_missed_periods;
+  kt_gate_start = kt_now;
+  gate_missed_periods = 0;
+
+  /* no formatting here. the text output (if requested) is created
+     in process context by device_read() */
+  ring_put(&record);
+  write_sequnlock(&gate_lock);
+  trace_freemcan_sample(record.sequence, record.accu_counts,
+                        latency_ns, overruns);
+}
+
+
+/** Emit the record of the last preset count boundary
+ *
+ * Tasklet scheduled by the ISR which counted the last pulse. The gate
+ * ends when the counts are folded here, not at the boundary. The
+ * pulses which come meanwhile are part of the record, hence it holds
+ * at least preset_counts pulses and its rate is not biased.
+ */
+static void
+preset_emit(unsigned long unused){
+  unsigned long flags;
+
+  /* a boundary of a stopped measurement */
+  if (!ACCESS_ONCE(timebase_running))
+    return;
+  /* the boundary came while the last run folded the counts */
+  const u64 sequence = atomic64_read(&preset_sequence);
+  if (sequence == preset_emitted_sequence)
+    return;
+  preset_emitted_sequence = sequence;
+  /* the timer callback takes gate_lock and readers_lock in irq
+     context */
+  local_irq_save(flags);
+  const ktime_t kt_now = ktime_get();
+  sample_emit(kt_now, sequence, 0, 0);
+  readers_wake(ktime_to_ns(ktime_sub(kt_now, kt_start)));
+  local_irq_restore(flags);
+}
+
+static DECLARE_TASKLET(preset_tasklet, preset_emit, 0);
+
+
+/** Compute the storm limit from the module parameters */
+static void
+storm_init(void){
+  int i;
+
+  storm_window_jiffies = max_t(unsigned long,
+                               msecs_to_jiffies(storm_window_ms), 1);
+  storm_holdoff_jiffies = msecs_to_jiffies(storm_holdoff_ms);
+  /* the window is a whole number of jiffies */
+  storm_limit = (storm_rate_hz == 0) ? 0 :
+    max_t(u32, div_u64((u64)storm_rate_hz * jiffies_to_msecs(storm_window_jiffies),
+                       MSEC_PER_SEC), 1);
+  for (i = 0; i < MAX_CHANNELS; i++){
+    channels[i].storm_holdoff = storm_holdoff_jiffies;
+    /* the first storm is no comeback */
+    channels[i].storm_unmasked_at = jiffies - storm_holdoff_jiffies - 1;
+  }
+}
+
+
+/** Count an edge towards the storm limit and mask the irq line if it
+ *  is exceeded
+ *
+ * Called from the ISR. Returns true if the channel is masked.
+ */
+static inline bool
+storm_check(channel_t *ch){
+  const unsigned long now = jiffies;
+
+  if (time_after_eq(now, ch->storm_window + storm_window_jiffies)){
+    ch->storm_window = now;
+    ch->storm_edges = 0;
+  }
+  if (++ch->storm_edges <= storm_limit)
+    return false;
+
+  /* back off if the storm comes back right away */
+  if (time_before(now, ch->storm_unmasked_at + ch->storm_holdoff))
+    ch->storm_holdoff = min_t(unsigned long, 2 * ch->storm_holdoff + 1,
+                              max_t(unsigned long, storm_holdoff_jiffies,
+                                    msecs_to_jiffies(STORM_HOLDOFF_MS_MAX)));
+  else
+    ch->storm_holdoff = storm_holdoff_jiffies;
+  ch->storm_masked_at = now;
+  ch->storms++;
+  set_bit(ch - channels, &storm_saturated);
+#ifndef TEST_ON_X86
+  /* we are the handler of this line, do not wait for ourselves */
+  disable_irq_nosync(ch->irq);
+#endif
+  /* the timebase reads the hold off after the flag */
+  smp_wmb();
+  ACCESS_ONCE(ch->storm_masked) = 1;
+  printk_ratelimited(KERN_ALERT "freemcan: interrupt storm on channel %d, "
+                     "masked for %u ms\n", (int)(ch - channels),
+                     jiffies_to_msecs(ch->storm_holdoff));
+  return true;
+}
+
+
+/** Enable the irq lines whose hold off is over
+ *
+ * Called by the timer callback, hence the hold off is rounded up to
+ * the timer period.
+ */
+static void
+storm_unmask(void){
+  const unsigned long now = jiffies;
+  int i;
+
+  for (i = 0; i < n_channels; i++){
+    channel_t *ch = &channels[i];
+    if (!ACCESS_ONCE(ch->storm_masked))
+      continue;
+    smp_rmb();
+    if (time_before(now, ch->storm_masked_at + ch->storm_holdoff))
+      continue;
+    /* the line is still masked, nobody else writes the channel */
+    ch->storm_unmasked_at = now;
+    ch->storm_window = now;
+    ch->storm_edges = 0;
+    smp_wmb();
+    ACCESS_ONCE(ch->storm_masked) = 0;
+#ifndef TEST_ON_X86
+    enable_irq(ch->irq);
+#endif
+  }
+}
+
+
+/** Enable all masked irq lines regardless of the hold off
+ *
+ * Called at start and stop of the measurement with the timebase
+ * canceled, a stopped timebase unmasks nothing.
+ */
+static void
+storm_unmask_all(void){
+  int i;
+
+  for (i = 0; i < n_channels; i++){
+    channel_t *ch = &channels[i];
+    if (!ACCESS_ONCE(ch->storm_masked))
+      continue;
+    smp_rmb();
+    ch->storm_unmasked_at = jiffies;
+    ch->storm_window = ch->storm_unmasked_at;
+    ch->storm_edges = 0;
+    ch->storm_holdoff = storm_holdoff_jiffies;
+    smp_wmb();
+    ACCESS_ONCE(ch->storm_masked) = 0;
+#ifndef TEST_ON_X86
+    enable_irq(ch->irq);
+#endif
+  }
+}
+
+
+/** Everything the interrupt of a channel does
+ *
+ * Shared by the gpio interrupt and the pulse simulator.
+ */
+static inline void
+handle_pulse(channel_t *ch){
+  const u64 dead_time = ACCESS_ONCE(dead_time_ns);
+  u64 now = 0;
+
+  this_cpu_inc(pulse_counts.isr_calls[ch - channels]);
+  trace_freemcan_pulse(ch - channels);
+  /* edges of a masked channel (the simulator has no irq line to mask)
+     are not counted, the records are flagged instead */
+  if (ACCESS_ONCE(ch->storm_masked))
+    return;
+  if (storm_limit && (!ACCESS_ONCE(storm_bypass)) && storm_check(ch))
+    return;
+  if (dead_time){
+    /* non paralyzable: the dead time starts with an accepted edge */
+    now = ktime_to_ns(ktime_get());
+    if (now - ch->last_edge_ns < dead_time){
+      this_cpu_inc(pulse_counts.rejected[ch - channels]);
+      return;
+    }
+    ch->last_edge_ns = now;
+  }
+  count_pulse(ch, now);
+
+  /* exactly one pulse reaches the preset. it counts the boundary,
+     the record is emitted by the tasklet */
+  const unsigned int preset = ACCESS_ONCE(preset_counts);
+  if (preset && ACCESS_ONCE(timebase_running) &&
+      (atomic_inc_return(&preset_pulses) == preset)){
+    atomic_sub(preset, &preset_pulses);
+    atomic64_inc(&preset_sequence);
+    tasklet_schedule(&preset_tasklet);
+  }
+}
+
+
+#ifndef TEST_ON_X86
 static irqreturn_t
 my_interrupt_handler(int irq, void* dev_id)
 {
-   atomic_inc(&accu_counts);
+   handle_pulse(dev_id);
    return IRQ_HANDLED;
 }
+#else
+/** -ln(r / 2^32) in Q16
+ *
+ * No floating point in the kernel. log2 by repeated squaring of the
+ * mantissa, 16 fractional bits.
+ */
+static u32
+sim_neg_ln_q16(u32 r){
+  u32 log2_q16;
+  u64 m;
+  int i;
+
+  if (r == 0)
+    r = 1;
+  const unsigned int msb = fls(r) - 1;
+  /* mantissa in [1, 2) as Q31 */
+  m = (u64)r << (31 - msb);
+  log2_q16 = msb << 16;
+  for (i = 15; i >= 0; i--){
+    m = (m * m) >> 31;
+    if (m >= (2ULL << 31)){
+      m >>= 1;
+      log2_q16 |= 1 << i;
+    }
+  }
+  /* -ln(x) = -log2(x) * ln(2), ln(2) = 45426 / 2^16 */
+  return ((u64)((32 << 16) - log2_q16) * 45426) >> 16;
+}
+
+
+/** Timer callback function for the pulse simulator
+ *
+ * Bursts start as a poisson process (exponential intervals), every
+ * burst hits one randomly chosen channel. The pulses take the same
+ * path as a gpio interrupt.
+ */
+static enum hrtimer_restart sim_callback(struct hrtimer * unused)
+{
+  const ktime_t kt_now = hrtimer_cb_get_time(&hrt_sim);
+  const unsigned int rate = min_t(unsigned int, ACCESS_ONCE(sim_rate_hz),
+                                  SIM_RATE_MAX);
+  const unsigned int burst_len = clamp_t(unsigned int, ACCESS_ONCE(sim_burst_len),
+                                         1, SIM_BURST_MAX);
+  unsigned int i;
+
+  if ((rate == 0) ||
+      (ktime_to_ns(ktime_sub(kt_now, kt_sim_next)) > SIM_LAG_NS_MAX)){
+    /* off or stalled. start over */
+    kt_sim_next = kt_now;
+    if (rate == 0){
+      hrtimer_forward(&hrt_sim, kt_now, ns_to_ktime(SIM_IDLE_NS));
+      return HRTIMER_RESTART;
+    }
+  }
+  /* mean interval between the bursts */
+  const u64 mean_ns = div_u64((u64)burst_len * NSEC_PER_SEC, rate);
+  while (ktime_to_ns(kt_sim_next) <= ktime_to_ns(kt_now)){
+    channel_t *ch = &channels[(n_channels > 1) ? prandom_u32() % n_channels : 0];
+    for (i = 0; i < burst_len; i++)
+      handle_pulse(ch);
+    atomic64_add(burst_len, &sim_generated);
+    kt_sim_next = ktime_add_ns(kt_sim_next,
+                               (mean_ns * sim_neg_ln_q16(prandom_u32())) >> 16);
+  }
+
+  if (ktime_to_ns(kt_sim_next) > ktime_to_ns(kt_now) + SIM_TICK_NS_MIN)
+    hrtimer_set_expires(&hrt_sim, kt_sim_next);
+  else
+    hrtimer_set_expires(&hrt_sim, ktime_add_ns(kt_now, SIM_TICK_NS_MIN));
+  return HRTIMER_RESTART;
+}
 #endif
 
 
+/** Convert a record into a csv style text line
+ *
+ * Returns the number of characters written (without '\0')
+ */
+static int
+format_record(char *a_line, const sample_record_t *record)
+{
+  if (record->wall_clock != WALL_CLOCK_OFF)
+    return snprintf(a_line, TEXT_LINE_MAX,
+                    "event/time/count: ; %llu ; %llu ; %u ; %llu\n",
+                    (unsigned long long)record->sequence,
+                    (unsigned long long)div_u64(record->time_ns, NSEC_PER_MSEC),
+                    record->accu_counts,
+                    (unsigned long long)record->wall_ns);
+  return snprintf(a_line, TEXT_LINE_MAX,
+                  "event/time/count: ; %llu ; %llu ; %u\n",
+                  (unsigned long long)record->sequence,
+                  (unsigned long long)div_u64(record->time_ns, NSEC_PER_MSEC),
+                  record->accu_counts);
+}
+
+
 /** Timer callback function for timebase
  *
  * Collect timestamp and accu_counts in the ring buffer.
@@ -154,58 +1493,56 @@ my_interrupt_handler(int irq, void* dev_id)
  */
 static enum hrtimer_restart timer_callback(struct hrtimer * unused)
 {
-  unsigned char a_line[256];
-  fifo_data_t fifo_data;
-
   /* get the current time stamp */
   ktime_t kt_now = hrtimer_cb_get_time(&hrt_timebase);
+  /* how late are we? */
+  s64 latency_ns = ktime_to_ns(ktime_sub(kt_now,
+                                         hrtimer_get_expires(&hrt_timebase)));
+  if (latency_ns < 0)
+    latency_ns = 0;
   /* periodic timer */
   int overruns = hrtimer_forward(&hrt_timebase, kt_now, kt_period);
-  if (overruns > 1)
-    printk(KERN_ALERT "freemcan: timer events are missing\n");
+  if (overruns > 1){
+    /* the period cannot be met. keep track for IOCTL_GET_TIMEBASE */
+    atomic64_add(overruns - 1, &missed_timer_events);
+    debug_timer_overruns += overruns - 1;
+    /* the gate of a preset count record is no number of periods */
+    if (!ACCESS_ONCE(preset_counts))
+      gate_missed_periods += overruns - 1;
+    printk_ratelimited(KERN_ALERT "freemcan: timer events are missing\n");
+  }
+  debug_timer_calls++;
+  debug_latency_bins[min_t(unsigned int, fls64(latency_ns),
+                           LATENCY_HIST_BINS - 1)]++;
+  if (latency_ns > debug_latency_max_ns)
+    debug_latency_max_ns = latency_ns;
+  { cpu_stats_t *stats = this_cpu_ptr(&cpu_stats);
+  stats->timer_calls++;
+  stats->latency_sum_ns += latency_ns;
+  if (latency_ns > stats->latency_max_ns)
+    stats->latency_max_ns = latency_ns; }
 
   /* the timer softirq does not interrupt itself. timer_counts not
      necessarily atomic? */
-  const int act_timer_counts = atomic_read(&timer_counts);
-  atomic_inc(&timer_counts);
+  const u64 act_timer_counts = atomic64_inc_return(&timer_counts) - 1;
+  u64 act_timer_counts_rem = act_timer_counts;
 
 #ifndef TEST_ON_X86
     gpio_toggle(GPIO_TIMEBASE_LED);
 #endif
 
-  /* create each expired timercnts_per_sample a new ringbuffer element */
-  if (!(act_timer_counts % timercnts_per_sample)){
-
-    fifo_data.timer_counts = act_timer_counts;
-
-    /* absolute time since start of measurement */
-    ktime_t kt_diff = ktime_sub(kt_now, kt_start);
-    fifo_data.kernel_time = ktime_to_ms(kt_diff);
+  if (storm_limit)
+    storm_unmask();
 
-#ifndef TEST_ON_X86
-    /* function can be interrupted by the accu_count ISR because this
-       code is running inside a softirq */
-    fifo_data.accu_counts = atomic_xchg(&accu_counts, 0);
-#else
-    fifo_data.accu_counts = 1234;
-#endif
+  /* create each expired timercnts_per_sample a new ringbuffer element.
+     in preset count mode the tasklet does */
+  if ((!ACCESS_ONCE(preset_counts)) &&
+      (!do_div(act_timer_counts_rem, timercnts_per_sample)))
+    sample_emit(kt_now, act_timer_counts, latency_ns, overruns);
 
-    /* from now on treat the data simply as a stupid character stream */
-    /* create a csv style output */
-    int len = sprintf(a_line,
-                      "event/time/count: ; %d ; %d ; %d\n",
-                      fifo_data.timer_counts,
-                      fifo_data.kernel_time,
-                      fifo_data.accu_counts);
-
-    kfifo_in(&char_fifo, a_line, len);
-    //kfifo_in(&char_fifo,(unsigned char *)(&fifo_data),sizeof(fifo_data_t));
-
-    /* data ready to read. wake up reader task if it does sleep and
-       inform poll() */
-    SET_READABLE_FLAG;
-    wake_up_interruptible(&wq_read);
-  }
+  /* wake up the reader tasks which wait for enough data and inform
+     poll(). checked at every timer event because of the latency */
+  readers_wake(ktime_to_ns(ktime_sub(kt_now, kt_start)));
 
   return HRTIMER_RESTART;
 }
@@ -213,27 +1550,39 @@ static enum hrtimer_restart timer_callback(struct hrtimer * unused)
 
 /** Device open - service function
  *
- * Collect timestamp and accu_counts in the ring buffer.
- * Wake up reader tasks.
+ * Every open file is an independent reader. It starts with the next
+ * record and with the text format.
  */
 static int
 device_open(struct inode *inode, struct file *file)
 {
-  /* device is read only */
-  if (((file->f_flags & O_ACCMODE) == O_WRONLY)
-     || ((file->f_flags & O_ACCMODE) == O_RDWR))
+  reader_t *reader;
+  unsigned long flags;
+
+  /* device is read only. O_RDWR is accepted because a shared
+     writable mapping of the cursor page requires it */
+  if ((file->f_flags & O_ACCMODE) == O_WRONLY)
     return -EACCES;
 
-  /* brut force single-open policy. possibly that two different tasks
-     try to open the device at the same time, therefore atomic */
-  if (atomic_inc_and_test(&dev_use_count)){
-    /* success, only one instance */
-    return SUCCESS;
+  reader = kzalloc(sizeof(reader_t), GFP_KERNEL);
+  if (reader == NULL)
+    return -ENOMEM;
+  reader->ctrl = vmalloc_user(PAGE_SIZE);
+  if (reader->ctrl == NULL){
+    kfree(reader);
+    return -ENOMEM;
   }
-  /* already opened - reject */
-  atomic_dec(&dev_use_count);
+  reader->ctrl->tail = ACCESS_ONCE(ring_head);
+  reader->output_format = OUTPUT_FORMAT_TEXT;
+  reader->watermark = 1;
+  mutex_init(&reader->lock);
+  init_waitqueue_head(&reader->wq);
+  file->private_data = reader;
+  spin_lock_irqsave(&readers_lock, flags);
+  list_add_tail(&reader->list, &readers);
+  spin_unlock_irqrestore(&readers_lock, flags);
 
-  return -EBUSY;
+  return SUCCESS;
 }
 
 
@@ -242,12 +1591,105 @@ device_open(struct inode *inode, struct file *file)
 static int
 device_release(struct inode *inode, struct file *file)
 {
-  atomic_dec(&dev_use_count);
+  reader_t *reader = file->private_data;
+  unsigned long flags;
+
+  /* the measurement goes on, anybody may take it over */
+  mutex_lock(&control_lock);
+  if (control_owner == reader)
+    control_owner = NULL;
+  mutex_unlock(&control_lock);
+
+  spin_lock_irqsave(&readers_lock, flags);
+  list_del(&reader->list);
+  spin_unlock_irqrestore(&readers_lock, flags);
+  /* mappings hold a reference to the file, hence the cursor page is
+     not in use anymore */
+  vfree(reader->ctrl);
+  kfree(reader);
 
   return SUCCESS;
 }
 
 
+/** Send ringbuffer payload as text lines to user space
+ *
+ * Only whole lines are sent. Lines which do not fit into the user
+ * buffer remain in the ringbuffer.
+ */
+static ssize_t
+read_text(reader_t *reader, char __user *buffer, size_t length)
+{
+  char a_line[TEXT_LINE_MAX];
+  sample_record_t record;
+  size_t copied = 0;
+  u32 fill;
+  u32 tail = ring_get_tail(reader, &fill);
+
+  for (; fill > 0; fill--, tail++){
+    record = ring_data[tail & (ring_capacity - 1)];
+    if (ring_overwritten(tail)){
+      /* lapped while copying. skip the record */
+      reader->lost++;
+      continue;
+    }
+    const int len = format_record(a_line, &record);
+    if (copied + len > length)
+      break;
+    if (copy_to_user(buffer + copied, a_line, len)){
+      ring_set_tail(reader, tail);
+      return -EFAULT;
+    }
+    copied += len;
+  }
+  ring_set_tail(reader, tail);
+  /* user buffer too small to take a single line */
+  if ((!copied) && (fill > 0))
+    return -EINVAL;
+
+  return copied;
+}
+
+
+/** Send ringbuffer payload as binary records to user space
+ *
+ * Only whole records are sent.
+ */
+static ssize_t
+read_binary(reader_t *reader, char __user *buffer, size_t length)
+{
+  u32 fill, bad;
+  u32 tail;
+
+  if (length < sizeof(sample_record_t))
+    return -EINVAL;
+  do {
+    tail = ring_get_tail(reader, &fill);
+    const u32 pos = tail & (ring_capacity - 1);
+    if (fill > length / sizeof(sample_record_t))
+      fill = length / sizeof(sample_record_t);
+    /* two chunks if the records wrap around the end of the ring */
+    const u32 chunk = min_t(u32, fill, ring_capacity - pos);
+    if (copy_to_user(buffer, &ring_data[pos],
+                     chunk * sizeof(sample_record_t)))
+      return -EFAULT;
+    if (copy_to_user(buffer + chunk * sizeof(sample_record_t), &ring_data[0],
+                     (fill - chunk) * sizeof(sample_record_t)))
+      return -EFAULT;
+    /* the copy may sleep (page fault). if the producer lapped us in
+       the meantime skip the damaged records and copy again */
+    bad = min_t(u32, ring_overwritten(tail), fill);
+    if (bad){
+      reader->lost += bad;
+      ring_set_tail(reader, tail + bad);
+    }
+  } while (bad);
+  ring_set_tail(reader, tail + fill);
+
+  return fill * sizeof(sample_record_t);
+}
+
+
 /** Device read - service function
  *
  * Send ringbuffer payload to user space
@@ -256,32 +1698,45 @@ static ssize_t
 device_read(struct file *filp, char *buffer,
             size_t length, loff_t *offset)
 {
-  /* no data + nonblocking mode = return without any action */
-  if ( (!READABLE_FLAG) &&
-       (filp->f_flags & O_NONBLOCK) )
-    return -EAGAIN;
-  /* blocking mode and if no data available to send then put
-     process to SLEEP otherwise continue */
-  if (wait_event_interruptible(wq_read, READABLE_FLAG)) {
-    /* can be interrupted by a signal (e.g. KILL) during sleep */
-    return -ERESTARTSYS;
-  }
-  /* at this point data is available */
-
-  /* resetting the flag could possibly interrupted by an ISR
-     therefore it is atomic */
-  UNSET_READABLE_FLAG;
-
-  /* With only one concurrent reader and one concurrent writer,
-     we don't need extra locking. direct copy_to_user space
-     from the fifo. remove the data copied automatically from the
-     ringbuffer */
-  int ret_val;
-  unsigned int copied;
-  ret_val = kfifo_to_user(&char_fifo, buffer, length, &copied);
-  // ret_val = kfifo_out(&char_fifo, buffer, length);
-  /* -EFAULT or number of bytes copied respectively */
-  return ret_val ? ret_val : copied;
+  reader_t *reader = filp->private_data;
+  ssize_t ret_val;
+
+  do {
+    /* nonblocking mode: no data = return without any action, otherwise
+       take what is there. the watermark applies to blocking reads and
+       poll() only */
+    if (filp->f_flags & O_NONBLOCK){
+      if (!ring_fill(reader))
+        return -EAGAIN;
+    }
+    /* blocking mode and if not enough data available to send then put
+       process to SLEEP otherwise continue */
+    else if (wait_event_interruptible(reader->wq, READABLE_FLAG(reader))) {
+      /* can be interrupted by a signal (e.g. KILL) during sleep */
+      return -ERESTARTSYS;
+    }
+    /* at this point data is available */
+
+    /* the producer never waits for the readers, hence no locking
+       against the producer. direct copy_to_user space from the ring */
+    if (mutex_lock_interruptible(&reader->lock))
+      return -ERESTARTSYS;
+    if (reader->output_format == OUTPUT_FORMAT_TEXT)
+      ret_val = read_text(reader, buffer, length);
+    else
+      ret_val = read_binary(reader, buffer, length);
+    trace_freemcan_read(reader->output_format, length, ret_val,
+                        ring_fill(reader));
+    mutex_unlock(&reader->lock);
+    /* all records were lapped while copying. 0 would be the end of
+       the file, start over with the records which overwrote them */
+  } while (ret_val == 0);
+
+  atomic64_inc(&debug_read_calls);
+  if (ret_val > 0)
+    atomic64_add(ret_val, &debug_read_bytes);
+
+  return ret_val;
 }
 
 
@@ -290,20 +1745,139 @@ stop_firmware(void){
   /* \TODO what happens if a not running timer is canceled? */
   /* cancel the timer and wait until the ISR executes */
   hrtimer_cancel(&hrt_timebase);
-  wake_up_interruptible_all(&wq_read);
+  ACCESS_ONCE(timebase_running) = 0;
+  /* a boundary stamped meanwhile is dropped by the tasklet */
+  tasklet_kill(&preset_tasklet);
+  /* nobody would unmask a storm without the timebase */
+  storm_unmask_all();
+  /* flush the records below the watermark */
+  readers_wake_all();
+}
+
+
+/** Start the timebase pinned to the calling cpu
+ *
+ * Called via smp_call_function_single() on timer_cpu.
+ */
+static void
+timebase_start_on_cpu(void *unused){
+  hrtimer_start(&hrt_timebase, ktime_add(kt_start, kt_period),
+                HRTIMER_MODE_ABS_PINNED);
 }
 
 
 static inline void
 start_firmware(void){
-  hrtimer_start(&hrt_timebase, kt_period, HRTIMER_MODE_REL);
-  kt_start = hrtimer_cb_get_time(&hrt_timebase);
-  atomic_set(&timer_counts, 1);
+  int i;
+
+  atomic64_set(&timer_counts, 1);
+  atomic64_set(&missed_timer_events, 0);
+  atomic64_set(&sim_generated, 0);
+  atomic_set(&preset_pulses, 0);
+  atomic64_set(&preset_sequence, 0);
+  preset_emitted_sequence = 0;
+  ring_reset_stats();
+  /* a storm of the last measurement is not flagged in this one */
+  storm_unmask_all();
+  storm_saturated = 0;
 #ifndef TEST_ON_X86
-  disable_irq(gpio_irq_in_number);
-  atomic_set(&accu_counts, 0);
-  enable_irq(gpio_irq_in_number);
+  for (i = 0; i < n_channels; i++)
+    disable_irq(channels[i].irq);
 #endif
+  for (i = 0; i < n_channels; i++)
+    channels[i].last_pulse_ns = 0;
+  atomic_set(&coincidence_counts, 0);
+  interval_reset();
+  /* discard the pulses of the last measurement */
+  event_tail = event_head;
+  atomic_set(&event_overflows, 0);
+  /* a capture of the last measurement has the wrong time base */
+  mutex_lock(&capture_read_lock);
+  raw_spin_lock_irq(&pulse_lock);
+  capture_arm();
+  raw_spin_unlock_irq(&pulse_lock);
+  mutex_unlock(&capture_read_lock);
+  /* the first gate opens together with the counters. the timer is
+     started afterwards, it must not see the counters of the last
+     measurement. the timer callback takes gate_lock in irq context */
+  write_seqlock_irq(&gate_lock);
+  for (i = 0; i < n_channels; i++){
+    channels[i].folded_counts = pulse_count_sum(i);
+    channels[i].folded_rejected = rejected_sum(i);
+  }
+  atomic64_set(&recorded_counts, 0);
+  atomic_set(&capture_counts, 0);
+  kt_start = ktime_get();
+  kt_gate_start = kt_start;
+  kt_start_real_offset = ktime_sub(ktime_get_real(), kt_start);
+  kt_start_tai_offset = ktime_sub(ktime_get_clocktai(), kt_start);
+  write_sequnlock_irq(&gate_lock);
+  gate_missed_periods = 0;
+#ifndef TEST_ON_X86
+  for (i = 0; i < n_channels; i++)
+    enable_irq(channels[i].irq);
+#endif
+  ACCESS_ONCE(timebase_running) = 1;
+  /* a pinned hrtimer runs on the cpu which started it */
+  if ((timer_cpu >= 0) && (timer_cpu < nr_cpu_ids) && cpu_online(timer_cpu))
+    smp_call_function_single(timer_cpu, timebase_start_on_cpu, NULL, 1);
+  else
+    hrtimer_start(&hrt_timebase, ktime_add(kt_start, kt_period), HRTIMER_MODE_ABS);
+}
+
+
+/** Snapshot of the running sample
+ *
+ * Lockless against the timer, a snapshot which overlaps a sample
+ * boundary is taken again. The ISRs keep counting meanwhile.
+ */
+static void
+live_snapshot(live_snapshot_t *live){
+  ktime_t kt_gate, kt_now;
+  unsigned int seq;
+  int i;
+
+  do {
+    seq = read_seqbegin(&gate_lock);
+    kt_now = ktime_get();
+    kt_gate = kt_gate_start;
+    live->accu_counts = 0;
+    for (i = 0; i < MAX_CHANNELS; i++){
+      live->channel_counts[i] = (i < n_channels) ?
+        pulse_count_sum(i) - channels[i].folded_counts : 0;
+      live->accu_counts += live->channel_counts[i];
+    }
+    live->total_counts = atomic64_read(&recorded_counts) + live->accu_counts;
+  } while (read_seqretry(&gate_lock, seq));
+
+  /* as in the next record: masked now or since the last record */
+  live->saturated_channels = ACCESS_ONCE(storm_saturated);
+  for (i = 0; i < n_channels; i++)
+    if (ACCESS_ONCE(channels[i].storm_masked))
+      live->saturated_channels |= 1 << i;
+  live->reserved = 0;
+
+  live->time_ns = ktime_to_ns(ktime_sub(kt_now, kt_start));
+  live->gate_elapsed_ns = ktime_to_ns(ktime_sub(kt_now, kt_gate));
+  live->channels = n_channels;
+}
+
+
+/** Take control_lock if the reader may control the measurement
+ *
+ * Returns SUCCESS with control_lock held, -EBUSY if another reader
+ * runs the measurement or -ERESTARTSYS.
+ */
+static int
+control_begin(reader_t *reader){
+  if (mutex_lock_interruptible(&control_lock))
+    return -ERESTARTSYS;
+  if (ACCESS_ONCE(timebase_running) && control_owner &&
+      (control_owner != reader)){
+    mutex_unlock(&control_lock);
+    return -EBUSY;
+  }
+  return SUCCESS;
 }
 
 
@@ -316,27 +1890,237 @@ device_ioctl(struct file *file,
              unsigned int ioctl_num,
              unsigned long ioctl_param)
 {
+  reader_t *reader = file->private_data;
+
   switch (ioctl_num) {
 
     case IOCTL_GET_FIFO_LEN:
-       /* get the minimum number of readable characters for lets say a
-          readAll() implementation in user space */
-       { const ssize_t len = kfifo_len(&char_fifo);
-       return len; }
+       /* get the number of characters required to read all pending
+          data for lets say a readAll() implementation in user space.
+          in text mode this is an upper bound */
+       { const ssize_t len = min_t(u32, ring_fill(reader), ring_capacity);
+       if (reader->output_format == OUTPUT_FORMAT_TEXT)
+         return len * TEXT_LINE_MAX;
+       return len * sizeof(sample_record_t); }
     break;
     case IOCTL_START_MEASUREMENT:
+       /* waits for a benchmark, its pulses would end up in the
+          records */
+       { const int ret_val = control_begin(reader);
+       if (ret_val < 0)
+         return ret_val;
        stop_firmware();
        start_firmware();
+       control_owner = reader;
+       mutex_unlock(&control_lock); }
     break;
     case IOCTL_STOP_MEASUREMENT:
+       { const int ret_val = control_begin(reader);
+       if (ret_val < 0)
+         return ret_val;
        stop_firmware();
+       control_owner = NULL;
+       mutex_unlock(&control_lock); }
     break;
     case IOCTL_SET_TCNTSPERSAMPLE:
+       /* an invalid request leaves the measurement running */
+       { unsigned int cps;
+       if (copy_from_user(&cps,
+                         (unsigned int *)ioctl_param,
+                         sizeof(unsigned int)) )
+         return -EACCES;
+       if (cps == 0)
+         return -EINVAL;
+       const int ret_val = control_begin(reader);
+       if (ret_val < 0)
+         return ret_val;
        stop_firmware();
-       if (copy_from_user(&timercnts_per_sample,
+       control_owner = NULL;
+       timercnts_per_sample = cps;
+       mutex_unlock(&control_lock); }
+    break;
+    case IOCTL_SET_PRESET_COUNTS:
+       { unsigned int counts;
+       if (copy_from_user(&counts,
                          (unsigned int *)ioctl_param,
                          sizeof(unsigned int)) )
          return -EACCES;
+       if ((counts != 0) && (counts < PRESET_COUNTS_MIN))
+         return -EINVAL;
+       const int ret_val = control_begin(reader);
+       if (ret_val < 0)
+         return ret_val;
+       stop_firmware();
+       control_owner = NULL;
+       preset_counts = counts;
+       mutex_unlock(&control_lock); }
+    break;
+    case IOCTL_SET_PERIOD_NS:
+       /* the timer is reprogrammed on the next start */
+       { u64 period_ns;
+       if (copy_from_user(&period_ns, (u64 *)ioctl_param, sizeof(u64)))
+         return -EACCES;
+       if ((period_ns < PERIOD_NS_MIN) || (period_ns > PERIOD_NS_MAX))
+         return -EINVAL;
+       const int ret_val = control_begin(reader);
+       if (ret_val < 0)
+         return ret_val;
+       stop_firmware();
+       control_owner = NULL;
+       kt_period = ns_to_ktime(period_ns);
+       mutex_unlock(&control_lock); }
+    break;
+    case IOCTL_GET_TIMEBASE:
+       { timebase_status_t status;
+       status.period_ns = ktime_to_ns(kt_period);
+       status.timer_events = atomic64_read(&timer_counts) - 1;
+       status.missed_events = atomic64_read(&missed_timer_events);
+       status.running = ACCESS_ONCE(timebase_running);
+       status.reserved = 0;
+       if (copy_to_user((timebase_status_t *)ioctl_param, &status, sizeof(status)))
+         return -EACCES; }
+    break;
+    case IOCTL_GET_FIFO_STATS:
+       { fifo_stats_t stats;
+       mutex_lock(&reader->lock);
+       ring_get_stats(reader, &stats);
+       mutex_unlock(&reader->lock);
+       if (copy_to_user((fifo_stats_t *)ioctl_param, &stats, sizeof(stats)))
+         return -EACCES; }
+    break;
+    case IOCTL_SET_OUTPUT_FORMAT:
+       /* the ringbuffer holds records. the format is applied at read()
+          time, hence it can be switched while the timer is running */
+       { unsigned int format;
+       if (copy_from_user(&format,
+                         (unsigned int *)ioctl_param,
+                         sizeof(unsigned int)) )
+         return -EACCES;
+       if ((format != OUTPUT_FORMAT_TEXT) &&
+           (format != OUTPUT_FORMAT_BINARY))
+         return -EINVAL;
+       reader->output_format = format; }
+    break;
+    case IOCTL_SET_EVENT_MODE:
+       { unsigned int mode;
+       if (copy_from_user(&mode,
+                         (unsigned int *)ioctl_param,
+                         sizeof(unsigned int)) )
+         return -EACCES;
+       ACCESS_ONCE(event_mode) = (mode != 0); }
+    break;
+    case IOCTL_READ_EVENTS:
+       { event_read_t arg;
+       if (copy_from_user(&arg, (event_read_t *)ioctl_param, sizeof(arg)))
+         return -EACCES;
+       mutex_lock(&event_read_lock);
+       const int copied = event_read((u64 __user *)(uintptr_t)arg.buffer,
+                                     arg.count);
+       mutex_unlock(&event_read_lock);
+       if (copied < 0)
+         return copied;
+       arg.count = copied;
+       arg.overflows = atomic_read(&event_overflows);
+       if (copy_to_user((event_read_t *)ioctl_param, &arg, sizeof(arg)))
+         return -EACCES; }
+    break;
+    case IOCTL_SET_CAPTURE:
+       { capture_config_t config;
+       if (copy_from_user(&config, (capture_config_t *)ioctl_param, sizeof(config)))
+         return -EACCES;
+       return capture_config(&config, sample_counts()); }
+    break;
+    case IOCTL_READ_CAPTURE:
+       { capture_read_t arg;
+       if (copy_from_user(&arg, (capture_read_t *)ioctl_param, sizeof(arg)))
+         return -EACCES;
+       mutex_lock(&capture_read_lock);
+       const int ret_val = capture_read(&arg);
+       mutex_unlock(&capture_read_lock);
+       if (ret_val < 0)
+         return ret_val;
+       if (copy_to_user((capture_read_t *)ioctl_param, &arg, sizeof(arg)))
+         return -EACCES; }
+    break;
+    case IOCTL_RUN_BENCHMARK:
+       { benchmark_t bench;
+       if (copy_from_user(&bench, (benchmark_t *)ioctl_param, sizeof(bench)))
+         return -EACCES;
+       if ((bench.rate_hz < BENCH_RATE_MIN) ||
+           (bench.rate_hz > BENCH_RATE_MAX) ||
+           (bench.duration_ns < BENCH_DURATION_NS_MIN) ||
+           (bench.duration_ns > BENCH_DURATION_NS_MAX))
+         return -EINVAL;
+       int ret_val = control_begin(reader);
+       if (ret_val < 0)
+         return ret_val;
+       stop_firmware();
+       control_owner = NULL;
+       ret_val = bench_run(&bench);
+       mutex_unlock(&control_lock);
+       if (ret_val < 0)
+         return ret_val;
+       if (copy_to_user((benchmark_t *)ioctl_param, &bench, sizeof(bench)))
+         return -EACCES; }
+    break;
+    case IOCTL_GET_INTERVAL_HIST:
+       return interval_read((interval_hist_t __user *)ioctl_param);
+    break;
+    case IOCTL_RESET_INTERVAL_HIST:
+       interval_reset();
+    break;
+    case IOCTL_SET_WAKEUP:
+       { wakeup_t wakeup;
+       if (copy_from_user(&wakeup, (wakeup_t *)ioctl_param, sizeof(wakeup)))
+         return -EACCES;
+       u32 records = wakeup.watermark;
+       if (wakeup.unit == WAKEUP_BYTES)
+         records = DIV_ROUND_UP(records,
+                                (reader->output_format == OUTPUT_FORMAT_TEXT) ?
+                                TEXT_LINE_MAX : sizeof(sample_record_t));
+       else if (wakeup.unit != WAKEUP_RECORDS)
+         return -EINVAL;
+       ACCESS_ONCE(reader->watermark) = clamp_t(u32, records, 1, ring_capacity);
+       ACCESS_ONCE(reader->max_latency_ns) = wakeup.max_latency_ns;
+       /* the new condition may hold already */
+       wake_up_interruptible(&reader->wq); }
+    break;
+    case IOCTL_GET_PULSE_STATS:
+       { pulse_stats_t stats;
+       stats.generated = atomic64_read(&sim_generated);
+       stats.recorded = atomic64_read(&recorded_counts);
+       if (copy_to_user((pulse_stats_t *)ioctl_param, &stats, sizeof(stats)))
+         return -EACCES; }
+    break;
+    case IOCTL_SET_WALL_CLOCK:
+       /* takes effect with the next record */
+       { unsigned int clock;
+       if (copy_from_user(&clock,
+                         (unsigned int *)ioctl_param,
+                         sizeof(unsigned int)) )
+         return -EACCES;
+       if ((clock != WALL_CLOCK_OFF) && (clock != WALL_CLOCK_REALTIME) &&
+           (clock != WALL_CLOCK_TAI))
+         return -EINVAL;
+       ACCESS_ONCE(wall_clock) = clock; }
+    break;
+    case IOCTL_GET_CLOCK_OFFSETS:
+       { clock_offsets_t offsets;
+       unsigned int seq;
+       do {
+         seq = read_seqbegin(&gate_lock);
+         offsets.start_monotonic_ns = ktime_to_ns(kt_start);
+         offsets.realtime_offset_ns = ktime_to_ns(kt_start_real_offset);
+         offsets.tai_offset_ns = ktime_to_ns(kt_start_tai_offset);
+       } while (read_seqretry(&gate_lock, seq));
+       if (copy_to_user((clock_offsets_t *)ioctl_param, &offsets, sizeof(offsets)))
+         return -EACCES; }
+    break;
+    case IOCTL_GET_LIVE:
+       { live_snapshot_t live;
+       live_snapshot(&live);
+       if (copy_to_user((live_snapshot_t *)ioctl_param, &live, sizeof(live)))
+         return -EACCES; }
     break;
     default:
        printk(KERN_INFO "freemcan: unknown IOCTL:%d\n",ioctl_num);
@@ -348,24 +2132,281 @@ device_ioctl(struct file *file,
 }
 
 
+/** Device mmap - service function
+ *
+ * Offset 0 is the cursor page of this reader (may be writable),
+ * offset PAGE_SIZE is the control page of the ring, the records follow
+ * at ring_ctrl->data_offset (both read only).
+ */
+static int
+device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  reader_t *reader = filp->private_data;
+
+  if (vma->vm_pgoff == 0){
+    /* checks the size against the vmalloc area */
+    return remap_vmalloc_range(vma, reader->ctrl, 0);
+  }
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+  vma->vm_flags &= ~VM_MAYWRITE;
+
+  /* checks the size and offset against the vmalloc area */
+  return remap_vmalloc_range(vma, ring_mem, vma->vm_pgoff - 1);
+}
+
+
 /** Device select and poll - service function
  *
  */
 static unsigned int
 device_poll (struct file *file, poll_table *wait)
 {
+  reader_t *reader = file->private_data;
   unsigned int mask = 0;
 
-  poll_wait(file, &wq_read, wait);
+  poll_wait(file, &reader->wq, wait);
 
   /* data ready to read? */
-  if (READABLE_FLAG) {
+  if (READABLE_FLAG(reader)) {
     mask |= POLLIN | POLLRDNORM;
   }
   return mask;
 }
 
 
+/** debugfs "stats": counters since the module was loaded */
+static int
+debug_stats_show(struct seq_file *m, void *unused)
+{
+  reader_t *reader;
+  unsigned long flags;
+  int i, cpu, n = 0;
+
+  seq_printf(m, "isr_calls:");
+  for (i = 0; i < n_channels; i++){
+    u64 calls = 0;
+    for_each_possible_cpu(cpu)
+      calls += per_cpu(pulse_counts, cpu).isr_calls[i];
+    seq_printf(m, " %llu", (unsigned long long)calls);
+  }
+  seq_printf(m, "\nrejected:");
+  for (i = 0; i < n_channels; i++)
+    seq_printf(m, " %u", rejected_sum(i));
+  seq_printf(m, "\nstorms:");
+  for (i = 0; i < n_channels; i++)
+    seq_printf(m, " %u%s", ACCESS_ONCE(channels[i].storms),
+               ACCESS_ONCE(channels[i].storm_masked) ? " (masked)" : "");
+  seq_printf(m, "\ntimer_calls: %llu\n"
+             "timer_overruns: %llu\n"
+             "timer_latency_max_ns: %llu\n"
+             "wakeups: %llu\n"
+             "read_calls: %llu\n"
+             "read_bytes: %llu\n"
+             "ring_capacity: %u\n"
+             "ring_head: %u\n",
+             (unsigned long long)ACCESS_ONCE(debug_timer_calls),
+             (unsigned long long)ACCESS_ONCE(debug_timer_overruns),
+             (unsigned long long)ACCESS_ONCE(debug_latency_max_ns),
+             (unsigned long long)ACCESS_ONCE(debug_wakeups),
+             (unsigned long long)atomic64_read(&debug_read_calls),
+             (unsigned long long)atomic64_read(&debug_read_bytes),
+             ring_capacity, ACCESS_ONCE(ring_head));
+  /* fill level of every reader */
+  spin_lock_irqsave(&readers_lock, flags);
+  list_for_each_entry(reader, &readers, list)
+    seq_printf(m, "reader %d: fill %u hwm %u lost %llu watermark %u\n", n++,
+               min_t(u32, ring_fill(reader), ring_capacity),
+               reader->fill_hwm, (unsigned long long)reader->lost,
+               reader->watermark);
+  spin_unlock_irqrestore(&readers_lock, flags);
+  return 0;
+}
+
+
+/** debugfs "cpus": pulse interrupts and timebase latency per cpu */
+static int
+debug_cpus_show(struct seq_file *m, void *unused)
+{
+  int i, cpu;
+
+  for_each_online_cpu(cpu){
+    const pulse_counts_t *counts = &per_cpu(pulse_counts, cpu);
+    const cpu_stats_t *stats = &per_cpu(cpu_stats, cpu);
+    u64 isr_calls = 0;
+    for (i = 0; i < n_channels; i++)
+      isr_calls += counts->isr_calls[i];
+    seq_printf(m, "cpu %d: isr_calls %llu timer_calls %llu "
+               "timer_latency_avg_ns %llu timer_latency_max_ns %llu\n",
+               cpu, (unsigned long long)isr_calls,
+               (unsigned long long)stats->timer_calls,
+               (unsigned long long)(stats->timer_calls ?
+                 div64_u64(stats->latency_sum_ns, stats->timer_calls) : 0),
+               (unsigned long long)stats->latency_max_ns);
+  }
+  return 0;
+}
+
+
+/** debugfs "timer_latency": one "upper bound in ns ; count" per bin */
+static int
+debug_latency_show(struct seq_file *m, void *unused)
+{
+  int i;
+
+  for (i = 0; i < LATENCY_HIST_BINS; i++)
+    seq_printf(m, "%llu ; %u\n", 1ULL << i, ACCESS_ONCE(debug_latency_bins[i]));
+  return 0;
+}
+
+
+static int
+debug_stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, debug_stats_show, NULL);
+}
+
+
+static int
+debug_latency_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, debug_latency_show, NULL);
+}
+
+
+static int
+debug_cpus_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, debug_cpus_show, NULL);
+}
+
+
+static const struct file_operations debug_stats_fops = {
+  .owner = THIS_MODULE,
+  .open = debug_stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
+
+static const struct file_operations debug_latency_fops = {
+  .owner = THIS_MODULE,
+  .open = debug_latency_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
+
+static const struct file_operations debug_cpus_fops = {
+  .owner = THIS_MODULE,
+  .open = debug_cpus_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
+
+/** Create /sys/kernel/debug/freemcan/
+ *
+ * The module works without debugfs, hence errors are ignored.
+ */
+static void
+__init debug_init(void)
+{
+  debug_dir = debugfs_create_dir("freemcan", NULL);
+  if (IS_ERR_OR_NULL(debug_dir)){
+    debug_dir = NULL;
+    return;
+  }
+  debugfs_create_file("stats", S_IRUGO, debug_dir, NULL, &debug_stats_fops);
+  debugfs_create_file("timer_latency", S_IRUGO, debug_dir, NULL,
+                      &debug_latency_fops);
+  debugfs_create_file("cpus", S_IRUGO, debug_dir, NULL, &debug_cpus_fops);
+}
+
+
+#ifndef TEST_ON_X86
+/** Request the gpio pin and the irq line of all channels */
+static int
+__init channels_init(void)
+{
+  int i, ret_val;
+
+  if (!strcmp(trigger_edge, "rising"))
+    trigger_flags = IRQF_TRIGGER_RISING;
+  else if (!strcmp(trigger_edge, "falling"))
+    trigger_flags = IRQF_TRIGGER_FALLING;
+  else if (!strcmp(trigger_edge, "both"))
+    trigger_flags = IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING;
+  else
+    return -EINVAL;
+
+  for (i = 0; i < n_channels; i++){
+    channel_t *ch = &channels[i];
+    ch->gpio = gpio_pins[i];
+    ret_val = gpio_request_one(ch->gpio, GPIOF_IN, "IRQ Input Pin");
+    if (ret_val < 0)
+      goto err_channels;
+    ch->irq = gpio_to_irq(ch->gpio);
+    if (ch->irq < 0){
+      ret_val = ch->irq;
+      goto err_gpio;
+    }
+    /* NOTE 1:
+     * our gpio pin / IRQ is assigned to one driver only (non shared IRQ).
+     * the channel is passed as ID to the handler.
+     * NOTE 2:
+     * we do not use threaded interrupt processing since our handler is very
+     * small. so everything is processed inside interrupt context.
+     * NOTE 3: IRQF_DISABLED is not maintained. hence note that IRQs
+     * remain enabled except the caller IRQ line(?).
+     */
+    ret_val = request_irq(ch->irq,
+                          my_interrupt_handler,
+                          trigger_flags |
+                          IRQF_DISABLED,
+                          "freemcan-gc",
+                          ch);
+    if (ret_val < 0)
+      goto err_gpio;
+    /* only a hint for irqbalance and user space on older kernels. not
+       every irq chip can be moved, hence not fatal */
+    if ((irq_cpu >= 0) && (irq_cpu < nr_cpu_ids) &&
+        (irq_set_affinity_hint(ch->irq, cpumask_of(irq_cpu)) < 0))
+      printk(KERN_INFO "freemcan: cannot pin irq %d to cpu %d\n",
+             ch->irq, irq_cpu);
+  }
+  return SUCCESS;
+
+err_gpio:
+  gpio_free(channels[i].gpio);
+err_channels:
+  while (--i >= 0){
+    irq_set_affinity_hint(channels[i].irq, NULL);
+    free_irq(channels[i].irq, &channels[i]);
+    gpio_free(channels[i].gpio);
+  }
+  return ret_val;
+}
+
+
+static void
+channels_exit(void)
+{
+  int i;
+
+  for (i = 0; i < n_channels; i++){
+    /* free_irq() complains about a hint which is still set */
+    irq_set_affinity_hint(channels[i].irq, NULL);
+    free_irq(channels[i].irq, &channels[i]);
+    gpio_free(channels[i].gpio);
+  }
+}
+#endif
+
+
 /** Firmware initialization
  *
  * Called when insmod is issued
@@ -380,38 +2421,30 @@ __init firmware_init(void)
   if (ret_val < 0)
     goto gpio_timebase_exit;
 
-  ret_val = gpio_request_one(GPIO_INTERRUPT_PIN, GPIOF_IN, "IRQ Input Pin");
-  if (ret_val < 0)
+  if ((n_channels == 0) || (n_channels > MAX_CHANNELS))
     goto gpio_irq_exit;
-
-  gpio_irq_in_number = gpio_to_irq(GPIO_INTERRUPT_PIN);
-  if (gpio_irq_in_number < 0)
-    goto err_irq_return;
-
-  /* NOTE 1:
-   * our gpio pin / IRQ is assigned to one driver only (non shared IRQ).
-   * therefore we will not pass a uniqe ID but only NULL.
-   * NOTE 2:
-   * we do not use threaded interrupt processing since our handler is very
-   * small. so everything is processed inside interrupt context.
-   * NOTE 3: IRQF_DISABLED is not maintained. hence note that IRQs
-   * remain enabled except the caller IRQ line(?).
-   */
-  ret_val = request_irq(gpio_irq_in_number,
-                        my_interrupt_handler,
-                        IRQF_TRIGGER_RISING |
-                        IRQF_TRIGGER_FALLING |
-                        IRQF_DISABLED,
-                        "freemcan-gc",
-                        NULL);
+  ret_val = channels_init();
   if (ret_val < 0)
-    goto err_irq_return;
+    goto gpio_irq_exit;
+  if (bench_gpio >= 0){
+    ret_val = gpio_request_one(bench_gpio, GPIOF_OUT_INIT_LOW, "Benchmark Pin");
+    if (ret_val < 0)
+      goto err_free_channels;
+  }
+#else
+  if ((n_channels == 0) || (n_channels > MAX_CHANNELS))
+    return -EINVAL;
 #endif
+  storm_init();
+
+  /* setup the ringbuffer */
+  if (ring_init() < 0)
+    goto err_free_bench;
 
   /* setup the character device */
   /* get device number automatically */
   if (alloc_chrdev_region(&device_number, 0, 1, "freemcan-gc") < 0)
-    return -EIO;
+    goto err_free_ring;
   /* character device object to register */
   driver_object = cdev_alloc();
   if (driver_object == NULL)
@@ -432,16 +2465,25 @@ __init firmware_init(void)
                              NULL, device_number,
                              NULL, "%s", DEVICE_NAME);
 
-  /* setup the ringbuffer */
-  INIT_KFIFO(char_fifo);
-
-  /* setup the timer period (seconds,nanoseconds) */
+  /* setup the default timer period (seconds,nanoseconds). may be
+     changed with IOCTL_SET_PERIOD_NS */
   kt_period = ktime_set(1, 0);
   /* wanna be independant from systime */
   hrtimer_init (&hrt_timebase, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
   hrt_timebase.function = timer_callback;
+  hrtimer_init (&hrt_bench, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  hrt_bench.function = bench_callback;
   if (hrtimer_is_hres_active(&hrt_timebase) > 0)
     printk(KERN_INFO "freemcan: timer has high resolution\n");
+  debug_init();
+
+#ifdef TEST_ON_X86
+  /* no tube, the simulator produces the pulses */
+  hrtimer_init(&hrt_sim, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  hrt_sim.function = sim_callback;
+  kt_sim_next = ktime_get();
+  hrtimer_start(&hrt_sim, kt_sim_next, HRTIMER_MODE_ABS);
+#endif
 
   printk(KERN_INFO "freemcan-gc succesfully loaded\n");
   return SUCCESS;
@@ -450,9 +2492,14 @@ free_cdev:
   kobject_put(&driver_object->kobj);
 free_device_number:
   unregister_chrdev_region(device_number, 1);
+err_free_ring:
+  ring_exit();
+err_free_bench:
 #ifndef TEST_ON_X86
-err_irq_return:
-  gpio_free(GPIO_INTERRUPT_PIN);
+  if (bench_gpio >= 0)
+    gpio_free(bench_gpio);
+err_free_channels:
+  channels_exit();
 gpio_irq_exit:
   gpio_free(GPIO_TIMEBASE_LED);
 gpio_timebase_exit:
@@ -471,13 +2518,22 @@ module_init(firmware_init);
 static void
 __exit firmware_exit(void)
 {
+  /* the timers feed and unmask the irq lines, stop them before the
+     lines are freed */
+  hrtimer_cancel(&hrt_timebase);
+  ACCESS_ONCE(timebase_running) = 0;
+  hrtimer_cancel(&hrt_bench);
 #ifndef TEST_ON_X86
-  gpio_free(GPIO_INTERRUPT_PIN);
+  channels_exit();
+  if (bench_gpio >= 0)
+    gpio_free(bench_gpio);
   gpio_free(GPIO_TIMEBASE_LED);
-  free_irq(gpio_irq_in_number, NULL);
+#else
+  hrtimer_cancel(&hrt_sim);
 #endif
-  hrtimer_cancel(&hrt_timebase);
-  wake_up_interruptible(&wq_read);
+  /* no ISR schedules the preset tasklet any more */
+  tasklet_kill(&preset_tasklet);
+  debugfs_remove_recursive(debug_dir);
   /* erase sysfs item and hence the device file */
   device_destroy(device_class, device_number);
   class_destroy(device_class);
@@ -485,6 +2541,7 @@ __exit firmware_exit(void)
   cdev_del(driver_object);
   /* free range of reserved device number */
   unregister_chrdev_region( device_number, 1 );
+  ring_exit();
   printk(KERN_INFO "freemcan-gc exit\n");
 }
 
@@ -24,9 +24,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -46,6 +48,14 @@
 
 static int fd_chardev;
 static int fd_stdin;
+/* record ring shared with the firmware (NULL if read() is used) */
+static const ring_ctrl_t *ring_ctrl;
+static const sample_record_t *ring_data;
+static reader_ctrl_t *reader_ctrl;
+/* records lost because we were too slow (mmap() only) */
+static unsigned long long ring_lost;
+/* sum of the accu_counts received since start (mmap() only) */
+static unsigned long long received_counts;
 static struct termios orig_term_attr;
 static struct termios new_term_attr;
 
@@ -54,24 +64,179 @@ enum HOTKEYS{
   KEY_STARTMSRMNT = 's',
   KEY_PERSECOND = '1',
   KEY_PERMINUTE = '9',
+  KEY_EVENTMODE = 'e',
+  KEY_PERIOD = 'p',
+  KEY_INFO = 'i',
+  KEY_BENCHMARK = 'b',
+  KEY_HISTOGRAM = 'h',
+  KEY_HISTRESET = 'r',
+  KEY_WATERMARK = 'w',
+  KEY_LIVE = 'l',
+  KEY_PRESET = 'n',
+  KEY_CAPTURE = 'c',
+  KEY_WALLCLOCK = 't',
   KEY_QUIT = 'q'
 };
 
+/* per pulse timestamps on/off and where they go to */
+static unsigned int event_mode = 0;
+static FILE *fd_events;
+static time_t start_time;
+static unsigned long long event_overflows;
+/* highest pulse rate in Hz the timestamps are drained in time for. the
+   records may come far less often (long samples, KEY_WATERMARK), hence
+   select() times out after half the event ring at this rate */
+#define EVENT_RATE_MAX 100000
+#define EVENT_DRAIN_US (EVENT_RING_SIZE / 2 * (1000000ULL / EVENT_RATE_MAX))
+
+/* pulse rates of the KEY_BENCHMARK sweep in Hz */
+static const uint64_t bench_rates[] = {
+  1000, 10000, 30000, 100000, 300000, 1000000, 3000000, 10000000
+};
+
+/* timer periods selectable by KEY_PERIOD */
+static const uint64_t periods_ns[] = {
+  1000000000, 100000000, 10000000, 1000000, 100000
+};
+static unsigned int period_idx = 0;
+
+/* pulses per record selectable by KEY_PRESET, 0 = preset time */
+static const unsigned int preset_counts[] = {
+  0, 100, 1000, 10000
+};
+static unsigned int preset_idx = 0;
+
+/* burst capture thresholds selectable by KEY_CAPTURE, 0 = off */
+static const unsigned int capture_thresholds[] = {
+  0, 10, 100, 1000
+};
+static unsigned int capture_idx = 0;
+#define CAPTURE_PRE_EVENTS 256
+#define CAPTURE_POST_EVENTS 1024
+
+/* absolute timestamps in the records (KEY_WALLCLOCK) */
+static unsigned int wall_clock = WALL_CLOCK_OFF;
+static const char * const wall_clock_names[] = { "off", "realtime", "tai" };
+
+/* wake up once per batch of records (KEY_WATERMARK). the latency
+   bounds the delay at low rates */
+#define BATCH_RECORDS 64
+#define BATCH_LATENCY_NS 1000000000ULL
+static unsigned int batch_mode = 0;
+
 
 /** Get a filename for the logfile */
-char *export_get_filename(const time_t time)
+char *export_get_filename(const time_t time, const char reason, const char *ext)
 {
   const struct tm *tm_ = localtime(&time);
-  char reason = 'X';
   char *prefix = "data";
   char date[128];
   strftime(date, sizeof(date), "%Y-%m-%d.%H:%M:%S", tm_);
   static char fname[256];
-  snprintf(fname, sizeof(fname), "%s.%s.%c.%s", prefix, date, reason, "csv");
+  snprintf(fname, sizeof(fname), "%s.%s.%c.%s", prefix, date, reason, ext);
   return fname;
 }
 
 
+/** Drain the per pulse timestamps and write one "ns ; channel" per line */
+void
+events_drain(void){
+  uint64_t timestamps[1024];
+  event_read_t arg;
+
+  do {
+    arg.buffer = (uintptr_t)timestamps;
+    arg.count = sizeof(timestamps)/sizeof(timestamps[0]);
+    if (ioctl(fd_chardev, IOCTL_READ_EVENTS, &arg) < 0){
+      printf("ioctl failed\n");
+      return;
+    }
+    for (unsigned int i = 0; i < arg.count; i++)
+      fprintf(fd_events, "%llu ; %u\n",
+              (unsigned long long)(timestamps[i] & EVENT_TIME_MASK),
+              (unsigned int)(timestamps[i] >> EVENT_CHANNEL_SHIFT));
+  } while (arg.count == sizeof(timestamps)/sizeof(timestamps[0]));
+
+  if (arg.overflows != event_overflows){
+    printf("event ring overflow: %llu pulses lost\n",
+           (unsigned long long)arg.overflows);
+    event_overflows = arg.overflows;
+  }
+}
+
+
+/** Fetch a frozen burst capture and write it to its own file, one
+ *  "ns ; channel" per line. the triggering pulse is marked */
+void
+capture_drain(void){
+  static uint64_t timestamps[CAPTURE_EVENTS_MAX];
+  capture_read_t arg;
+
+  arg.buffer = (uintptr_t)timestamps;
+  arg.count = sizeof(timestamps)/sizeof(timestamps[0]);
+  if (ioctl(fd_chardev, IOCTL_READ_CAPTURE, &arg) < 0){
+    printf("ioctl failed\n");
+    return;
+  }
+  if (arg.count == 0)
+    return;
+  /* one file per capture, the name has a resolution of seconds */
+  char ext[32];
+  snprintf(ext, sizeof(ext), "%llu.cap", (unsigned long long)arg.captures);
+  FILE *fd_capture = fopen(export_get_filename(start_time, 'C', ext), "w");
+  if (fd_capture == NULL){
+    printf("cannot open capture file\n");
+    return;
+  }
+  for (unsigned int i = 0; i < arg.count; i++)
+    fprintf(fd_capture, "%llu ; %u%s\n",
+            (unsigned long long)(timestamps[i] & EVENT_TIME_MASK),
+            (unsigned int)(timestamps[i] >> EVENT_CHANNEL_SHIFT),
+            (i == arg.pre_events) ? " ; trigger" : "");
+  fclose(fd_capture);
+  printf("burst capture %llu at %llu ms: %u timestamps, %u before the trigger\n",
+         (unsigned long long)arg.captures,
+         (unsigned long long)(arg.trigger_ns / 1000000),
+         arg.count, arg.pre_events);
+}
+
+
+/** Lower edge of an interval histogram bin in ns */
+uint64_t
+interval_bin_ns(unsigned int bin){
+  if (bin < 4)
+    return bin;
+  return (uint64_t)(4 + bin % 4) << (bin / 4 - 1);
+}
+
+
+/** Write the inter-arrival time histogram, one "ns ; counts per
+ *  channel" line per non empty bin */
+int
+histogram_export(void){
+  interval_hist_t hist;
+
+  if (ioctl(fd_chardev, IOCTL_GET_INTERVAL_HIST, &hist) < 0)
+    return -1;
+  FILE *fd_hist = fopen(export_get_filename(time(NULL), 'H', "hst"), "w");
+  if (fd_hist == NULL)
+    return -1;
+  for (unsigned int bin = 0; bin < INTERVAL_HIST_BINS; bin++){
+    uint64_t sum = 0;
+    for (unsigned int ch = 0; ch < hist.channels; ch++)
+      sum += hist.bins[ch][bin];
+    if (!sum)
+      continue;
+    fprintf(fd_hist, "%llu", (unsigned long long)interval_bin_ns(bin));
+    for (unsigned int ch = 0; ch < hist.channels; ch++)
+      fprintf(fd_hist, " ; %u", hist.bins[ch][bin]);
+    fprintf(fd_hist, "\n");
+  }
+  fclose(fd_hist);
+  return 0;
+}
+
+
 /** Plot the raw data */
 void
 print_buf(char *buffer, int len){
@@ -82,6 +247,89 @@ print_buf(char *buffer, int len){
 }
 
 
+/** Map the record ring of the firmware
+ *
+ * The cursor page of this reader is mapped writable, the control page
+ * and the records read only. On failure the hostware falls back to
+ * read()
+ */
+int
+ring_map(void){
+  const long page_size = sysconf(_SC_PAGESIZE);
+  void *cursor = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd_chardev, 0);
+  if (cursor == MAP_FAILED)
+    return -1;
+  void *ctrl = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd_chardev, page_size);
+  if (ctrl == MAP_FAILED)
+    goto exit_unmap_cursor;
+  ring_ctrl = ctrl;
+  if ((ring_ctrl->version != RING_VERSION) ||
+      (ring_ctrl->record_size != sizeof(sample_record_t)))
+    goto exit_unmap;
+  void *data = mmap(NULL, ring_ctrl->capacity * ring_ctrl->record_size,
+                    PROT_READ, MAP_SHARED, fd_chardev, ring_ctrl->data_offset);
+  if (data == MAP_FAILED)
+    goto exit_unmap;
+  ring_data = data;
+  reader_ctrl = cursor;
+  return 0;
+
+exit_unmap:
+  munmap(ctrl, page_size);
+  ring_ctrl = NULL;
+exit_unmap_cursor:
+  munmap(cursor, page_size);
+  return -1;
+}
+
+
+/** Consume all records from the ring and write them as csv lines
+ *
+ * The firmware does not wait for us. Records which were overwritten
+ * before or while they were copied are skipped and counted.
+ */
+void
+ring_consume(FILE *fd_out){
+  char a_line[128];
+  const uint32_t capacity = ring_ctrl->capacity;
+  const uint32_t head = __atomic_load_n(&ring_ctrl->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = reader_ctrl->tail;
+
+  if (head - tail > capacity){
+    ring_lost += head - tail - capacity;
+    tail = head - capacity;
+  }
+  for (; tail != head; tail++){
+    const sample_record_t record = ring_data[tail & (capacity - 1)];
+    /* the copy is valid only if the firmware did not lap us meanwhile */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ring_ctrl->head, __ATOMIC_RELAXED) - tail >= capacity){
+      ring_lost++;
+      continue;
+    }
+    received_counts += record.accu_counts;
+    /* same format as the firmware text output */
+    int len = snprintf(a_line, sizeof(a_line),
+                       "event/time/count: ; %llu ; %llu ; %u",
+                       (unsigned long long)record.sequence,
+                       (unsigned long long)(record.time_ns / 1000000),
+                       record.accu_counts);
+    if (record.wall_clock != WALL_CLOCK_OFF)
+      len += snprintf(a_line + len, sizeof(a_line) - len, " ; %llu",
+                      (unsigned long long)record.wall_ns);
+    len += snprintf(a_line + len, sizeof(a_line) - len, "\n");
+    fwrite(a_line, 1, len, fd_out);
+    print_buf(a_line, len);
+    if (record.saturated_channels)
+      printf("interrupt storm: channels 0x%x masked, counts are too low\n",
+             record.saturated_channels);
+  }
+  /* poll() reports readable as long as tail != head */
+  __atomic_store_n(&reader_ctrl->tail, tail, __ATOMIC_RELEASE);
+}
+
+
 /** The user state machine */
 int
 hostware_ctrl(char * ch){
@@ -94,6 +342,7 @@ hostware_ctrl(char * ch){
         printf("ioctl failed:%d\n", ret_val);
       else
         printf("start measurement\n");
+      received_counts = 0;
     break;
     case KEY_STOPMSRMNT:
       ret_val = ioctl(fd_chardev, IOCTL_STOP_MEASUREMENT, NULL);
@@ -104,19 +353,189 @@ hostware_ctrl(char * ch){
     break;
     case KEY_PERMINUTE:
       timercounts_per_sample = 60;
-      ioctl(fd_chardev, IOCTL_SET_TCNTSPERSAMPLE, &timercounts_per_sample);
+      ret_val = ioctl(fd_chardev, IOCTL_SET_TCNTSPERSAMPLE, &timercounts_per_sample);
       if (ret_val < 0)
         printf("ioctl failed:%d\n", ret_val);
       else
-        printf("60 seconds per sample\n");
+        printf("60 timer periods per sample\n");
     break;
     case KEY_PERSECOND:
       timercounts_per_sample = 1;
-      ioctl(fd_chardev, IOCTL_SET_TCNTSPERSAMPLE, &timercounts_per_sample);
+      ret_val = ioctl(fd_chardev, IOCTL_SET_TCNTSPERSAMPLE, &timercounts_per_sample);
       if (ret_val < 0)
         printf("ioctl failed:%d\n", ret_val);
       else
-        printf("1 second per sample\n");
+        printf("1 timer period per sample\n");
+    break;
+    case KEY_PERIOD:
+      period_idx = (period_idx + 1) % (sizeof(periods_ns)/sizeof(periods_ns[0]));
+      ret_val = ioctl(fd_chardev, IOCTL_SET_PERIOD_NS, &periods_ns[period_idx]);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("timer period %llu us\n",
+               (unsigned long long)(periods_ns[period_idx] / 1000));
+    break;
+    case KEY_INFO:
+      { timebase_status_t status;
+      ret_val = ioctl(fd_chardev, IOCTL_GET_TIMEBASE, &status);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("timer period %llu ns, timer events %llu, missed %llu%s\n",
+               (unsigned long long)status.period_ns,
+               (unsigned long long)status.timer_events,
+               (unsigned long long)status.missed_events,
+               status.running ? "" : " (stopped)"); }
+      { fifo_stats_t stats;
+      ret_val = ioctl(fd_chardev, IOCTL_GET_FIFO_STATS, &stats);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("ring buffer %u/%u records (max %u), written %llu, dropped %llu (%llu bytes)\n",
+               stats.fill, stats.capacity, stats.fill_hwm,
+               (unsigned long long)stats.records_written,
+               /* the firmware does not know what a mmap() reader lost */
+               (unsigned long long)(stats.records_dropped + ring_lost),
+               (unsigned long long)(stats.bytes_dropped
+                                    + ring_lost * sizeof(sample_record_t))); }
+      { pulse_stats_t stats;
+      ret_val = ioctl(fd_chardev, IOCTL_GET_PULSE_STATS, &stats);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else if (ring_ctrl)
+        printf("pulses generated %llu, recorded %llu, received %llu\n",
+               (unsigned long long)stats.generated,
+               (unsigned long long)stats.recorded, received_counts);
+      else
+        printf("pulses generated %llu, recorded %llu\n",
+               (unsigned long long)stats.generated,
+               (unsigned long long)stats.recorded); }
+      { clock_offsets_t offsets;
+      ret_val = ioctl(fd_chardev, IOCTL_GET_CLOCK_OFFSETS, &offsets);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("start at monotonic %llu ns, realtime offset %lld ns, tai offset %lld ns\n",
+               (unsigned long long)offsets.start_monotonic_ns,
+               (long long)offsets.realtime_offset_ns,
+               (long long)offsets.tai_offset_ns); }
+    break;
+    case KEY_BENCHMARK:
+      /* stops the measurement. one second per rate until pulses are
+         lost */
+      { unsigned int i;
+      for (i = 0; i < sizeof(bench_rates)/sizeof(bench_rates[0]); i++){
+        benchmark_t bench;
+        bench.rate_hz = bench_rates[i];
+        bench.duration_ns = 1000000000;
+        ret_val = ioctl(fd_chardev, IOCTL_RUN_BENCHMARK, &bench);
+        if (ret_val < 0){
+          printf("ioctl failed:%d\n", ret_val);
+          break;
+        }
+        printf("benchmark %llu Hz: generated %llu, counted %llu\n",
+               (unsigned long long)bench.rate_hz,
+               (unsigned long long)bench.generated,
+               (unsigned long long)bench.counted);
+        if (bench.counted < bench.generated){
+          printf("pulses are lost above %llu Hz\n",
+                 (unsigned long long)(i ? bench_rates[i - 1] : 0));
+          break;
+        }
+      } }
+    break;
+    case KEY_HISTOGRAM:
+      ret_val = histogram_export();
+      if (ret_val < 0)
+        printf("cannot export the interval histogram\n");
+      else
+        printf("interval histogram written\n");
+    break;
+    case KEY_HISTRESET:
+      ret_val = ioctl(fd_chardev, IOCTL_RESET_INTERVAL_HIST, NULL);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("interval histogram cleared\n");
+    break;
+    case KEY_PRESET:
+      /* stops the measurement */
+      preset_idx = (preset_idx + 1) % (sizeof(preset_counts)/sizeof(preset_counts[0]));
+      ret_val = ioctl(fd_chardev, IOCTL_SET_PRESET_COUNTS, &preset_counts[preset_idx]);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else if (preset_counts[preset_idx])
+        printf("a record every %u counts\n", preset_counts[preset_idx]);
+      else
+        printf("a record every sample period\n");
+    break;
+    case KEY_CAPTURE:
+      { capture_config_t config;
+      capture_idx = (capture_idx + 1) % (sizeof(capture_thresholds)/sizeof(capture_thresholds[0]));
+      config.threshold = capture_thresholds[capture_idx];
+      config.pre_events = CAPTURE_PRE_EVENTS;
+      config.post_events = CAPTURE_POST_EVENTS;
+      config.reserved = 0;
+      ret_val = ioctl(fd_chardev, IOCTL_SET_CAPTURE, &config);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else if (config.threshold)
+        printf("burst capture above %u counts per sample\n", config.threshold);
+      else
+        printf("burst capture off\n"); }
+    break;
+    case KEY_WALLCLOCK:
+      wall_clock = (wall_clock + 1) % (sizeof(wall_clock_names)/sizeof(wall_clock_names[0]));
+      ret_val = ioctl(fd_chardev, IOCTL_SET_WALL_CLOCK, &wall_clock);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("wall clock timestamps %s\n", wall_clock_names[wall_clock]);
+    break;
+    case KEY_LIVE:
+      { live_snapshot_t live;
+      ret_val = ioctl(fd_chardev, IOCTL_GET_LIVE, &live);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("running sample: %u counts in %llu ms, total %llu counts in %llu ms%s\n",
+               live.accu_counts,
+               (unsigned long long)(live.gate_elapsed_ns / 1000000),
+               (unsigned long long)live.total_counts,
+               (unsigned long long)(live.time_ns / 1000000),
+               live.saturated_channels ? " (saturated)" : ""); }
+    break;
+    case KEY_WATERMARK:
+      { wakeup_t wakeup;
+      batch_mode = !batch_mode;
+      wakeup.watermark = batch_mode ? BATCH_RECORDS : 1;
+      wakeup.unit = WAKEUP_RECORDS;
+      wakeup.max_latency_ns = batch_mode ? BATCH_LATENCY_NS : 0;
+      ret_val = ioctl(fd_chardev, IOCTL_SET_WAKEUP, &wakeup);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else if (batch_mode)
+        printf("wake up every %u records or after %llu ms\n", BATCH_RECORDS,
+               BATCH_LATENCY_NS / 1000000);
+      else
+        printf("wake up on every record\n"); }
+    break;
+    case KEY_EVENTMODE:
+      event_mode = !event_mode;
+      if (event_mode && (fd_events == NULL)){
+        fd_events = fopen(export_get_filename(start_time, 'E', "evt"), "w");
+        if (fd_events == NULL){
+          printf("cannot open event file\n");
+          event_mode = 0;
+          break;
+        }
+      }
+      ret_val = ioctl(fd_chardev, IOCTL_SET_EVENT_MODE, &event_mode);
+      if (ret_val < 0)
+        printf("ioctl failed:%d\n", ret_val);
+      else
+        printf("per pulse timestamps %s\n", event_mode ? "on" : "off");
     break;
     case KEY_QUIT:
       return -1;
@@ -152,25 +571,47 @@ main (int argc, char *argv[])
   char buffer[BUFMAX];
 
   time_t now = time(NULL);
-  const char * logfile_name = export_get_filename(now);
+  start_time = now;
+  const char * logfile_name = export_get_filename(now, 'X', "csv");
   FILE *fd_out = fopen(logfile_name, "w");
   if (fd_out == NULL) return -1;
   rewind(fd_out);
 
-  fd_chardev = open("/dev/"DEVICE_NAME, O_RDONLY);
+  /* read/write access is needed to map the consumer index */
+  fd_chardev = open("/dev/"DEVICE_NAME, O_RDWR);
+  if (fd_chardev < 0)
+    fd_chardev = open("/dev/"DEVICE_NAME, O_RDONLY);
   printf("open character device: %d\n", fd_chardev);
   if (fd_chardev < 0) goto exit_nochardevice;
 
+  if (ring_map() < 0)
+    printf("cannot map the record ring, using read()\n");
+
   /* fcntl(fd_chardev, F_SETFL, O_NONBLOCK); */
 
   fd_stdin = 0;
   keyboard_init();
 
-  printf("hotkeys are: '%c':stop '%c':start '%c':per minute '%c':per second '%c':quit\n",
+  printf("hotkeys are: '%c':stop '%c':start '%c':60 periods '%c':1 period "
+         "'%c':timer period '%c':per pulse timestamps '%c':info '%c':benchmark "
+         "'%c':interval histogram '%c':clear histogram '%c':batch wakeups "
+         "'%c':running sample '%c':preset counts '%c':burst capture "
+         "'%c':wall clock '%c':quit\n",
          KEY_STOPMSRMNT,
          KEY_STARTMSRMNT,
          KEY_PERMINUTE,
          KEY_PERSECOND,
+         KEY_PERIOD,
+         KEY_EVENTMODE,
+         KEY_INFO,
+         KEY_BENCHMARK,
+         KEY_HISTOGRAM,
+         KEY_HISTRESET,
+         KEY_WATERMARK,
+         KEY_LIVE,
+         KEY_PRESET,
+         KEY_CAPTURE,
+         KEY_WALLCLOCK,
          KEY_QUIT);
 
   for (;;) {
@@ -187,12 +628,11 @@ main (int argc, char *argv[])
     nfds = max(nfds, fd_stdin);
     FD_SET(fd_chardev, &rfds);
     nfds = max(nfds, fd_chardev);
-    /* timeout */
-    /* struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    int retval = select(nfds + 1, &rfds, NULL, NULL, &tv); */
-    int retval = select(nfds + 1, &rfds, NULL, NULL, NULL);
+    /* timeout. the event ring fills up without any record */
+    struct timeval tv;
+    tv.tv_sec = EVENT_DRAIN_US / 1000000;
+    tv.tv_usec = EVENT_DRAIN_US % 1000000;
+    int retval = select(nfds + 1, &rfds, NULL, NULL, event_mode ? &tv : NULL);
     #ifdef PRINT_VERBOSE
     printf("main loop:\n");
     #endif
@@ -211,15 +651,26 @@ main (int argc, char *argv[])
         #ifdef PRINT_VERBOSE
         printf("\t3 (character device):\n");
         #endif
-        const int num_read = read(fd_chardev, buffer, BUFMAX);
-        fwrite(buffer, 1, num_read, fd_out);
-        print_buf(buffer, num_read);
+        if (ring_ctrl){
+          /* poll() wakes up only if the ring is not empty */
+          ring_consume(fd_out);
+        }else{
+          const int num_read = read(fd_chardev, buffer, BUFMAX);
+          fwrite(buffer, 1, num_read, fd_out);
+          print_buf(buffer, num_read);
+        }
+        if (capture_thresholds[capture_idx])
+          capture_drain();
       }
     }
     #ifdef PRINT_VERBOSE
     else
       printf("\t4 (timeout)\n");
     #endif
+    /* the timestamps are collected once per sample and at least every
+       EVENT_DRAIN_US */
+    if (event_mode)
+      events_drain();
   }
 
 exit_normal:
@@ -227,6 +678,8 @@ exit_normal:
   keyboard_exit();
   close(fd_chardev);
 exit_nochardevice:
+  if (fd_events)
+    fclose(fd_events);
   fclose(fd_out);
   exit(EXIT_SUCCESS);
 }
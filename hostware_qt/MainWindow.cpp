@@ -30,6 +30,16 @@
 #include "ui_MainWindow.h"
 
 
+/* time spans of the curve selectable with Ctrl+z. 0 = the last
+   samples as they are */
+static const qint64 viewSpansMs[] = {
+    0, 3600LL*1000, 24LL*3600*1000, 7LL*24*3600*1000, 30LL*24*3600*1000
+};
+static const char * const viewSpanNames[] = {
+    "last samples", "last hour", "last day", "last week", "last month"
+};
+
+
 /** setup the GUI API */
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
@@ -37,7 +47,6 @@ MainWindow::MainWindow(QWidget *parent) :
 {
     ui->setupUi(this);
 
-    mFifo = new Fifo(MAX_DATAPOINTS);
 
     connect(ui->actionExit,SIGNAL( triggered() ), qApp, SLOT( quit() ));
     connect(ui->actionAboutThis, SIGNAL(triggered()), this, SLOT(onActionAboutThis()) );
@@ -46,10 +55,15 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(startStopSc, SIGNAL( activated() ), this, SLOT( on_pushButton_clicked() ));
     QShortcut *exitSc = new QShortcut(QKeySequence("Ctrl+x"), this );
     connect(exitSc, SIGNAL( activated() ), qApp, SLOT( quit() ));
+    QShortcut *viewSc = new QShortcut(QKeySequence("Ctrl+z"), this);
+    connect(viewSc, SIGNAL( activated() ), this, SLOT( onViewSpan() ));
 
     msrmntRunning = 0;
 
     mParser = new Parser();
+    mDecoder = new Decoder();
+    liveTimer = new QTimer(this);
+    connect(liveTimer, SIGNAL( timeout() ), this, SLOT( onLiveTimer() ));
 
     port = new QcharDev();
     if (port->isOpen())
@@ -57,13 +71,28 @@ MainWindow::MainWindow(QWidget *parent) :
     /* unbuffered implies qint64 maxSize in QcharDev::readData() is used */
     port->open(QIODevice::ReadOnly | QIODevice::Unbuffered);
     if (port->isOpen()){
-        /* stop if firmware did already run before start of hostware */
-        port->stopMsrmnt();
+        timebase_status_t status;
+        /* somebody else runs a measurement. watch it, the firmware
+           does not let us stop or reconfigure it anyway */
+        attached = (port->getTimebase(&status) >= 0) && status.running;
+        /* prefer binary records. older firmware only talks text */
+        binaryMode = port->isMapped() ||
+                     (port->setOutputFormat(OUTPUT_FORMAT_BINARY) >= 0);
         connect(port, SIGNAL(readyRead()), this, SLOT(onDataAvailable()));
-        statusBar()->showMessage("Connection established",0);
-        ui->pushButton->setText("START");
-        connect(mParser, SIGNAL( parserDataReady(const payloadData *) ),
-                this, SLOT( onParserDataAvailable(const payloadData *) ));
+        if (attached){
+            statusBar()->showMessage("Attached to a running measurement (read only)",0);
+            ui->pushButton->setText("Attached");
+            ui->pushButton->setDisabled(true);
+            ui->comboBox->setDisabled(true);
+            liveTimer->start(500);
+        }else{
+            statusBar()->showMessage("Connection established",0);
+            ui->pushButton->setText("START");
+        }
+        connect(mParser, SIGNAL( parserDataReady(const payloadData *, int) ),
+                this, SLOT( onParserDataAvailable(const payloadData *, int) ));
+        connect(mDecoder, SIGNAL( parserDataReady(const payloadData *, int) ),
+                this, SLOT( onParserDataAvailable(const payloadData *, int) ));
     }else{
         disconnect(port, SIGNAL(readyRead()), this, SLOT(onDataAvailable()));
         statusBar()->showMessage("Error - cannot open device",0);
@@ -85,62 +114,143 @@ void MainWindow::onDataAvailable()
      qWarning() << "bytes minimum available:" << len; */
 
     QByteArray dataArray = port->readAll();
-    QString dataText(dataArray);
-    const int ret = mParser->doParse(dataArray.constData(), dataArray.size());
+    int ret;
+    if (binaryMode)
+        ret = mDecoder->doDecode(dataArray.constData(), dataArray.size());
+    else
+        ret = mParser->doParse(dataArray.constData(), dataArray.size());
     if (ret < 0)
-        statusBar()->showMessage("error parsing", 0);
+        statusBar()->showMessage(binaryMode ? QString("error parsing") :
+                                 QString("error parsing: %1 malformed lines")
+                                 .arg(mParser->malformedLines()), 0);
     else
         statusBar()->clearMessage();
 
     /* display the raw characters in a textlabel */
-    ui->labelChars->setText( dataText.replace("\n"," ") );
+    if (binaryMode){
+        ui->labelChars->setText(QString("Binary records: %1 bytes").arg(dataArray.size()));
+    }else{
+        QString dataText(dataArray);
+        ui->labelChars->setText( dataText.replace("\n"," ") );
+    }
 }
 
 
-/** parser finished. do something with the parsed data */
-void MainWindow::onParserDataAvailable(const payloadData *data)
+/** parser finished. do something with the parsed data. a batch of
+    records (e.g. after a stall) is accounted record by record but
+    displayed once */
+void MainWindow::onParserDataAvailable(const payloadData *batch, int count)
 {
+    for (int i = 0; i < count; i++){
+        totalCounts += batch[i].accuCounts;
+        /* divide by the measured live time if the firmware delivers it */
+        liveTimeNs += batch[i].gateNs;
+    }
+    mHistory.push(batch, count);
+    mPyramid.add(batch, count, (qint64)timerPeriodNs*timerCountsPerSample);
+
+    /* the labels show the newest record */
+    const payloadData *data = &batch[count - 1];
     QString dispTime = QString("Elapsed time: %1 sec").arg(data->kernelTime / 1000);
     ui->labelKernelTime ->setText(dispTime);
 
-    totalCounts += data->accuCounts;
     QString dispTotCnts = QString("Total Counts: %1").arg(totalCounts);
     ui->labelTotalCounts ->setText(dispTotCnts);
 
     QString dispAccuCounts = QString("Counts per interval: %1").arg(data->accuCounts);
+    /* the irq was masked for a while, the counts are a lower limit */
+    if (data->saturatedChannels)
+        dispAccuCounts += " (saturated)";
     ui->labelAccuCounts->setText(dispAccuCounts);
 
-    double cpm = 1000.0*60.0*(double)(totalCounts)/(double)(data->kernelTime);
+    double cpm = (liveTimeNs > 0) ?
+        60.0e9*(double)(totalCounts)/(double)(liveTimeNs) :
+        1000.0*60.0*(double)(totalCounts)/(double)(data->kernelTime);
     QString dispCPM = "Counts per minute: "+QString::number(cpm, 'f', 1)+" avrg";
     ui->labelCPM->setText(dispCPM);
 
-    mFifo->writeHead(data);
+    lastKernelTimeMs = data->kernelTime;
+    drawHistory();
+}
+
+
+/** draw the curve of the selected time span. a long span is drawn
+    from the history pyramid at the same cost as a short one */
+void MainWindow::drawHistory()
+{
+    const qint64 spanMs = viewSpansMs[viewSpanIdx];
+    if (spanMs > 0){
+        HistoryBucket buckets[MAX_DATAPOINTS];
+        double tmp[MAX_DATAPOINTS];
+        const int len = mPyramid.query(lastKernelTimeMs - spanMs, lastKernelTimeMs,
+                                       MAX_DATAPOINTS, buckets);
+        for (int i = 0; i < len; i++)
+            tmp[i] = buckets[i].meanCpm();
+        ui->paintArea->drawCurve(tmp, len, MAX_DATAPOINTS);
+        return;
+    }
+
     const int max_xticks = 60;
-    int recLen =  mFifo->copyLastN(max_xticks, dataBuffer);
+    int recLen =  mHistory.copyLastN(max_xticks, dataBuffer);
     double tmp[MAX_DATAPOINTS];
-    for (int i = 0; i < recLen; i++)
-        /* display in counts per minute */
-        tmp[i] = (60.0/(double)(timerCountsPerSample))*(double)(dataBuffer[i].accuCounts);
+    for (int i = 0; i < recLen; i++){
+        /* display in counts per minute. the nominal sample length is
+           biased if timer events were late or missed */
+        const double gateNs = (dataBuffer[i].gateNs > 0) ?
+            (double)dataBuffer[i].gateNs :
+            (double)timerPeriodNs*(double)timerCountsPerSample;
+        tmp[i] = (60.0e9/gateNs)*(double)(dataBuffer[i].accuCounts);
+    }
     ui->paintArea->drawCurve(tmp, recLen, max_xticks);
 }
 
 
+/** show the counts of the running sample. long samples would leave
+    the display unchanged for a minute otherwise */
+void MainWindow::onLiveTimer()
+{
+    live_snapshot_t live;
+
+    if (port->getLiveSnapshot(&live) < 0)
+        return;
+    QString dispTime = QString("Elapsed time: %1 sec").arg(live.time_ns / 1000000000);
+    ui->labelKernelTime->setText(dispTime);
+    QString dispTotCnts = QString("Total Counts: %1").arg(live.total_counts);
+    ui->labelTotalCounts->setText(dispTotCnts);
+}
+
+
 void MainWindow::on_pushButton_clicked()
 {
-    if (port->isOpen()){
+    if (port->isOpen() && !attached){
         if (msrmntRunning){
             port->stopMsrmnt();
             ui->pushButton->setText("Start");
             msrmntRunning = 0;
             totalCounts = 0;
+            liveTimeNs = 0;
+            liveTimer->stop();
             ui->comboBox->setEnabled(true);
         }else{
             timerCountsPerSample = ui->comboBox->currentText().toInt();
             ui->comboBox->setDisabled(true);
-            port->setTimerCountsPerSample(&timerCountsPerSample);
-            port->startMsrmnt();
+            /* the period is global state of the firmware. set it
+               explicitly, somebody else may have changed it */
+            if ((port->setPeriodNs(timerPeriodNs) < 0) ||
+                (port->setTimerCountsPerSample(&timerCountsPerSample) < 0) ||
+                (port->startMsrmnt() < 0)){
+                /* another program started a measurement meanwhile */
+                statusBar()->showMessage("Error - cannot start the measurement",0);
+                ui->comboBox->setEnabled(true);
+                return;
+            }
             ui->pushButton->setText("Stop");
-            mFifo->reset();
+            mHistory.reset();
+            mPyramid.reset();
+            lastKernelTimeMs = 0;
+            mDecoder->reset();
+            mParser->reset();
+            liveTimer->start(500);
             msrmntRunning = 1;
         }
     }
@@ -152,7 +262,17 @@ void MainWindow::onActionAboutThis()
     QMessageBox::about(this, tr("About application"),
                  tr("<p><b>Hotkeys:</b><br>" \
                     "<p><b>Exit:</b> Ctrl-x" \
-                    "<p><b>Start/Stop:</b> Ctrl-s <br>"));
+                    "<p><b>Start/Stop:</b> Ctrl-s" \
+                    "<p><b>Time span of the curve:</b> Ctrl-z <br>"));
+}
+
+
+/** next time span of the curve */
+void MainWindow::onViewSpan()
+{
+    viewSpanIdx = (viewSpanIdx + 1) % (sizeof(viewSpansMs)/sizeof(viewSpansMs[0]));
+    statusBar()->showMessage(QString("Curve: %1").arg(viewSpanNames[viewSpanIdx]), 0);
+    drawHistory();
 }
 
 
@@ -175,9 +295,14 @@ void MainWindow::saveFile()
     QFile file(fileToSave);
     if(file.open(QIODevice::WriteOnly | QIODevice::Text)){
         QTextStream outPut(&file);
-        int recLen =  mFifo->copyLastN(MAX_DATAPOINTS, dataBuffer);
-        for (int i = 0; i < recLen; i++)
-            outPut << i + 1 << ";" << dataBuffer[i].timerCounts << endl;
+        int recLen =  mHistory.copyLastN(MAX_DATAPOINTS, dataBuffer);
+        /* CSV, the first columns are line number and timer counts as
+           ever. the other fields follow, see CSV_SEPARATOR */
+        for (int i = 0; i < recLen; i++){
+            char line[192];
+            if (Parser::encodeCsv(i + 1, &dataBuffer[i], line, sizeof(line)) > 0)
+                outPut << line;
+        }
         file.close();
     }else{
         QMessageBox::warning(
@@ -27,12 +27,17 @@
 
 #include <QMainWindow>
 #include <QLabel>
+#include <QTimer>
 
 #include "qchardev.h"
 #include "parser.h"
-#include "fifo.h"
+#include "decoder.h"
+#include "spscring.h"
+#include "history.h"
 
 #define MAX_DATAPOINTS 100
+/* records kept for the display, a power of 2 above MAX_DATAPOINTS */
+#define HISTORY_RECORDS 128
 
 namespace Ui {
     class MainWindow;
@@ -50,17 +55,34 @@ private:
     void saveFile();
     QString fileToSave;
     Parser *mParser;
+    Decoder *mDecoder;
+    int binaryMode = 0;
     int msrmntRunning, totalCounts = 0;
+    /* watching a measurement which another program runs */
+    bool attached = false;
+    /* sum of the measured sample lengths (binary records only) */
+    qint64 liveTimeNs = 0;
     unsigned int timerCountsPerSample = 1;
+    quint64 timerPeriodNs = 1000000000;
     payloadData dataBuffer[MAX_DATAPOINTS];
     QcharDev *port;
-    Fifo *mFifo;
+    SpscRing<payloadData, HISTORY_RECORDS> mHistory;
+    /* the whole measurement at lower resolution */
+    HistoryPyramid mPyramid;
+    /* time span of the curve (Ctrl+z), index into viewSpansMs */
+    unsigned int viewSpanIdx = 0;
+    qint64 lastKernelTimeMs = 0;
+    void drawHistory();
+    /* refreshes the display between the samples */
+    QTimer *liveTimer;
     Ui::MainWindow *ui;
 
 
 private slots:
-    void onParserDataAvailable(const payloadData *data);
+    void onParserDataAvailable(const payloadData *data, int count);
     void onDataAvailable();
+    void onLiveTimer();
+    void onViewSpan();
     void onActionAboutThis();
     void on_pushButton_clicked();
     void onActionSaveFileAs();
@@ -0,0 +1,167 @@
+/** \file decoder.cpp
+* \brief Decoder to convert the kernel device binary record stream into numbers
+*
+* \author Copyright (C) 2014 samplemaker
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2.1
+* of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free
+* Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+* Boston, MA 02110-1301 USA
+*
+* @{
+*/
+
+
+#include <stddef.h>
+#include <string.h>
+#include <QtCore/QDebug>
+#include "decoder.h"
+
+
+Decoder::Decoder() {
+
+}
+
+
+Decoder::~Decoder()
+{
+
+}
+
+
+/* version and length. every record layout starts with them */
+static const int headerLen = offsetof(sample_record_t, accu_counts);
+
+
+/** drop a partially received record */
+void
+Decoder::reset(void){
+  mCarryLen = 0;
+  mSkip = 0;
+}
+
+
+/** Convert one record. Records of an unknown layout are rejected,
+    only their header is read */
+int
+Decoder::decodeRecord(const char *rec){
+  sample_record_t record;
+
+  /* the stream has no alignment guarantee */
+  memcpy(&record, rec, headerLen);
+  if ((record.version != RECORD_VERSION) ||
+      (record.length != sizeof(sample_record_t)))
+    return -1;
+  memcpy(&record, rec, sizeof(record));
+
+  PayloadFields::decode(mBatch[mBatchLen++], record);
+  if (mBatchLen == PAYLOAD_BATCH_MAX)
+    flush();
+  return 0;
+}
+
+
+/** Length of the record which starts at rec (header only)
+ *
+ * A record of an unknown layout is skipped by its length. If the
+ * length is garbage, too, the stream is out of step and as much as
+ * a record of the current layout is dropped.
+ */
+int
+Decoder::recordLength(const char *rec){
+  __u16 length;
+
+  memcpy(&length, rec + offsetof(sample_record_t, length), sizeof(length));
+  if ((length < headerLen) || (length > RECORD_SKIP_MAX))
+    return sizeof(sample_record_t);
+  return length;
+}
+
+
+/** Bytes mCarry has to hold to decode or skip the carried record */
+int
+Decoder::carryWanted(void) const{
+  if (mCarryLen < headerLen)
+    return headerLen;
+  return qMin(recordLength(mCarry), (int)sizeof(sample_record_t));
+}
+
+
+/** Convert a record into a binary record of the current layout */
+void
+Decoder::encode(const payloadData *data, sample_record_t *rec){
+  memset(rec, 0, sizeof(*rec));
+  rec->version = RECORD_VERSION;
+  rec->length = sizeof(sample_record_t);
+  PayloadFields::encode(*data, *rec);
+}
+
+
+/** Hand over the collected records */
+void
+Decoder::flush(void){
+  if (mBatchLen > 0){
+    emit parserDataReady(mBatch, mBatchLen);
+    mBatchLen = 0;
+  }
+}
+
+
+/** Decoder entry function
+ *
+ * Returns -1 if records of an unknown layout were skipped.
+ */
+int
+Decoder::doDecode(const char *stream, int len){
+  const int recLen = sizeof(sample_record_t);
+  int err = 0;
+  int i = 0;
+
+  while (i < len){
+    /* the rest of a long record of an unknown layout */
+    if (mSkip > 0){
+      const int n = qMin(mSkip, len - i);
+      mSkip -= n;
+      i += n;
+      continue;
+    }
+    const char *rec = &stream[i];
+    if ((mCarryLen == 0) && (len - i >= headerLen) &&
+        (len - i >= qMin(recordLength(rec), recLen))){
+      /* in one piece */
+      const int length = recordLength(rec);
+      const int taken = qMin(length, len - i);
+      i += taken;
+      mSkip = length - taken;
+    }else{
+      /* put a record split between two calls together. the header
+         first, it tells how much belongs to the record */
+      const int n = qMin(carryWanted() - mCarryLen, len - i);
+      memcpy(&mCarry[mCarryLen], rec, n);
+      mCarryLen += n;
+      i += n;
+      if (mCarryLen < carryWanted())
+        continue;
+      rec = mCarry;
+      mSkip = recordLength(rec) - mCarryLen;
+      mCarryLen = 0;
+    }
+    if (decodeRecord(rec) < 0)
+      err = -1;
+  }
+
+  /* the records of this buffer are handed over at once */
+  flush();
+
+  return err;
+}
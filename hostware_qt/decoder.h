@@ -0,0 +1,74 @@
+/** \file decoder.h
+* \brief Decoder to convert the kernel device binary record stream into numbers
+*
+* \author Copyright (C) 2014 samplemaker
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2.1
+* of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free
+* Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+* Boston, MA 02110-1301 USA
+*
+* @{
+*/
+
+
+#ifndef DECODER_H_
+#define DECODER_H_
+
+#include <QObject>
+#include "common_defs.h"
+#include "parser.h"
+
+/* the longest record of an unknown layout which is skipped by its
+   length. a longer length is garbage */
+#define RECORD_SKIP_MAX 4096
+
+/* counterpart of the Parser for OUTPUT_FORMAT_BINARY. there is nothing
+   to parse, the records are copied as they are */
+class Decoder : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit Decoder ();
+    ~Decoder ();
+    int doDecode(const char *stream, int len);
+    void reset(void);
+    /* the binary record of the firmware for a record. fields the
+       hostware does not know are 0 */
+    static void encode(const payloadData *data, sample_record_t *rec);
+
+signals:
+   /* see Parser */
+   void parserDataReady(const payloadData *data, int count);
+
+public slots:
+
+
+private:
+   int decodeRecord(const char *rec);
+   static int recordLength(const char *rec);
+   int carryWanted(void) const;
+   void flush(void);
+   /* the firmware sends whole records. a record is only split if the
+      stream comes from somewhere else (e.g. a file) */
+   char mCarry[sizeof(sample_record_t)];
+   int mCarryLen = 0;
+   /* the rest of a record of an unknown layout which is longer than
+      ours */
+   int mSkip = 0;
+   payloadData mBatch[PAYLOAD_BATCH_MAX];
+   int mBatchLen = 0;
+};
+
+#endif
@@ -0,0 +1,207 @@
+/** \file history.cpp
+* \brief Multi resolution history of the measurement
+*
+* \author Copyright (C) 2014 samplemaker
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2.1
+* of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free
+* Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+* Boston, MA 02110-1301 USA
+*
+* @{
+*/
+
+
+#include <QtCore/QDebug>
+#include "history.h"
+
+
+/* slot width and number of slots of each resolution. 68 minutes of
+   seconds, 34 hours of minutes, 170 days of hours, 11 years of days */
+static const qint64 levelWidthMs[HISTORY_LEVELS] = {
+  1000LL, 60LL*1000, 3600LL*1000, 24LL*3600*1000
+};
+static const unsigned int levelSize[HISTORY_LEVELS] = {
+  4096, 2048, 4096, 4096
+};
+
+
+HistoryPyramid::HistoryPyramid() {
+  for (int l = 0; l < HISTORY_LEVELS; l++){
+    mLevels[l].widthMs = levelWidthMs[l];
+    mLevels[l].size = levelSize[l];
+    mLevels[l].ring = new HistoryBucket[levelSize[l]];
+  }
+  reset();
+}
+
+
+HistoryPyramid::~HistoryPyramid()
+{
+  for (int l = 0; l < HISTORY_LEVELS; l++)
+    delete[] mLevels[l].ring;
+}
+
+
+/** forget everything (new measurement) */
+void
+HistoryPyramid::reset(void){
+  for (int l = 0; l < HISTORY_LEVELS; l++){
+    mLevels[l].first = 0;
+    mLevels[l].count = 0;
+  }
+}
+
+
+/** Fold in a batch of records */
+void
+HistoryPyramid::add(const payloadData *batch, int count, qint64 nominalGateNs){
+  for (int i = 0; i < count; i++){
+    const qint64 gateNs = (batch[i].gateNs > 0) ? batch[i].gateNs : nominalGateNs;
+    if ((gateNs <= 0) || (batch[i].kernelTime < 0))
+      continue;
+    const double cpm = 60.0e9*(double)batch[i].accuCounts/(double)gateNs;
+    for (int l = 0; l < HISTORY_LEVELS; l++)
+      addToLevel(&mLevels[l], batch[i].kernelTime, batch[i].accuCounts,
+                 gateNs, cpm);
+  }
+}
+
+
+/** Add a sample to the slot of its end time, open a new slot if the
+ *  time moved on
+ */
+void
+HistoryPyramid::addToLevel(Level *level, qint64 timeMs, qint64 counts,
+                           qint64 gateNs, double cpm){
+  const qint64 startMs = timeMs - timeMs % level->widthMs;
+
+  /* a sample from the past (should not happen) goes to the newest slot */
+  if ((level->count == 0) || (level->at(level->count - 1).startMs < startMs)){
+    if (level->count == level->size)
+      level->first++;
+    else
+      level->count++;
+    HistoryBucket &slot = level->at(level->count - 1);
+    slot.startMs = startMs;
+    slot.counts = 0;
+    slot.liveNs = 0;
+    slot.samples = 0;
+    slot.minCpm = cpm;
+    slot.maxCpm = cpm;
+  }
+  HistoryBucket &slot = level->at(level->count - 1);
+  slot.counts += counts;
+  slot.liveNs += gateNs;
+  slot.samples++;
+  if (cpm < slot.minCpm)
+    slot.minCpm = cpm;
+  if (cpm > slot.maxCpm)
+    slot.maxCpm = cpm;
+}
+
+
+/** Fold a slot into a bucket of the query */
+void
+HistoryPyramid::fold(HistoryBucket *bucket, const HistoryBucket &slot){
+  if (slot.startMs < bucket->startMs)
+    bucket->startMs = slot.startMs;
+  bucket->counts += slot.counts;
+  bucket->liveNs += slot.liveNs;
+  bucket->samples += slot.samples;
+  if (slot.minCpm < bucket->minCpm)
+    bucket->minCpm = slot.minCpm;
+  if (slot.maxCpm > bucket->maxCpm)
+    bucket->maxCpm = slot.maxCpm;
+}
+
+
+/** Get the history of a time range
+ *
+ * The finest resolution which still holds fromMs and needs no more
+ * than HISTORY_FOLD_MAX slots per bucket is used. Its slots are folded
+ * into buckets of a whole number of slots, aligned to the multiples of
+ * the bucket width so that a bucket does not change its slots when the
+ * range moves on. Hence the cost depends on maxBuckets only and not on
+ * the length of the range.
+ */
+int
+HistoryPyramid::query(qint64 fromMs, qint64 toMs, int maxBuckets,
+                      HistoryBucket *buckets) const{
+  if ((maxBuckets <= 0) || (toMs < fromMs))
+    return 0;
+
+  int l = 0;
+  for (; l < HISTORY_LEVELS - 1; l++){
+    const Level &level = mLevels[l];
+    const bool fits = ((toMs - fromMs) / level.widthMs + 1 <=
+                       (qint64)maxBuckets * HISTORY_FOLD_MAX);
+    /* the oldest slots of a full ring are gone */
+    const bool holds = (level.count < level.size) ||
+                       (level.at(0).startMs <= fromMs);
+    if (fits && holds)
+      break;
+  }
+  const Level &level = mLevels[l];
+
+  /* the slots are sorted by time. the first one which ends after
+     fromMs */
+  unsigned int lo = 0, hi = level.count;
+  while (lo < hi){
+    const unsigned int mid = lo + (hi - lo) / 2;
+    if (level.at(mid).startMs + level.widthMs <= fromMs)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  const unsigned int first = lo;
+  /* behind the last one which starts before toMs */
+  hi = level.count;
+  while (lo < hi){
+    const unsigned int mid = lo + (hi - lo) / 2;
+    if (level.at(mid).startMs <= toMs)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  const unsigned int last = lo;
+  if (first == last)
+    return 0;
+
+  /* slots per bucket. the aligned buckets may need one more than
+     maxBuckets, the oldest one is dropped then */
+  const qint64 spanSlots = (level.at(last - 1).startMs -
+                            level.at(first).startMs) / level.widthMs + 1;
+  const qint64 bucketMs = level.widthMs *
+                          ((spanSlots + maxBuckets - 1) / maxBuckets);
+  int n = 0;
+  qint64 bucketStartMs = 0;
+  for (unsigned int i = last; i-- > first; ){
+    const HistoryBucket &slot = level.at(i);
+    const qint64 startMs = slot.startMs - slot.startMs % bucketMs;
+    if ((n == 0) || (startMs != bucketStartMs)){
+      if (n == maxBuckets)
+        break;
+      bucketStartMs = startMs;
+      buckets[n++] = slot;
+    }else
+      fold(&buckets[n - 1], slot);
+  }
+  /* newest first so far */
+  for (int i = 0; i < n / 2; i++){
+    const HistoryBucket tmp = buckets[i];
+    buckets[i] = buckets[n - 1 - i];
+    buckets[n - 1 - i] = tmp;
+  }
+  return n;
+}
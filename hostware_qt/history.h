@@ -0,0 +1,102 @@
+/** \file history.h
+* \brief Multi resolution history of the measurement
+*
+* \author Copyright (C) 2014 samplemaker
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2.1
+* of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free
+* Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+* Boston, MA 02110-1301 USA
+*
+* @{
+*/
+
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <QtGlobal>
+#include "parser.h"
+
+
+/** the samples of one time slot folded together */
+class HistoryBucket
+{
+  public:
+    /* kernel time (ms since start) where the slot begins */
+    qint64 startMs;
+    /* sum of the counts */
+    qint64 counts;
+    /* sum of the sample lengths */
+    qint64 liveNs;
+    int samples;
+    /* lowest and highest rate of a single sample */
+    double minCpm;
+    double maxCpm;
+    /* rate of the whole slot */
+    double meanCpm(void) const {
+      return (liveNs > 0) ? 60.0e9*(double)counts/(double)liveNs : 0.0;
+    }
+};
+
+
+/** number of resolutions */
+#define HISTORY_LEVELS 4
+/** a query folds up to this many slots into one bucket before it
+    takes the next resolution. about the ratio of the resolutions,
+    hence a query returns close to the requested number of buckets */
+#define HISTORY_FOLD_MAX 60
+
+
+/* the samples are folded into slots of 1 s, 1 min, 1 h and 1 day. each
+   resolution keeps a fixed number of slots, the oldest are dropped.
+   the memory is bounded no matter how long the measurement runs */
+class HistoryPyramid
+{
+public:
+    explicit HistoryPyramid ();
+    ~HistoryPyramid ();
+    /* fold in a batch of records. samples without a measured length
+       (text format) are taken with nominalGateNs. O(1) per record */
+    void add(const payloadData *batch, int count, qint64 nominalGateNs);
+    /* the history of [fromMs, toMs] in at most maxBuckets buckets,
+       adjacent slots of the finest resolution which holds the range
+       are folded together. returns the number of buckets */
+    int query(qint64 fromMs, qint64 toMs, int maxBuckets,
+              HistoryBucket *buckets) const;
+    void reset(void);
+
+private:
+    Q_DISABLE_COPY(HistoryPyramid)
+    /* one resolution: a ring of slots, the newest is still growing */
+    class Level
+    {
+      public:
+        qint64 widthMs;
+        HistoryBucket *ring;
+        /* a power of 2 */
+        unsigned int size;
+        /* free running index of the oldest slot and number of slots */
+        unsigned int first;
+        unsigned int count;
+        HistoryBucket &at(unsigned int i) const {
+          return ring[(first + i) & (size - 1)];
+        }
+    };
+    void addToLevel(Level *level, qint64 timeMs, qint64 counts,
+                    qint64 gateNs, double cpm);
+    static void fold(HistoryBucket *bucket, const HistoryBucket &slot);
+    Level mLevels[HISTORY_LEVELS];
+};
+
+#endif
@@ -7,9 +7,11 @@ TARGET = hostware_qt
 INCLUDEPATH += ../include/
 
 # Input
-HEADERS += fifo.h MainWindow.h parser.h qchardev.h qdrawboxwidget.h
+HEADERS += decoder.h history.h MainWindow.h parser.h qchardev.h qdrawboxwidget.h \
+           schema.h spscring.h
 FORMS += MainWindow.ui
-SOURCES += fifo.cpp \
+SOURCES += decoder.cpp \
+           history.cpp \
            main.cpp \
            MainWindow.cpp \
            parser.cpp \
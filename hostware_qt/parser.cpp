@@ -23,11 +23,52 @@
 
 
 #include <QtCore/QDebug>
+#include <string.h>
 #include "parser.h"
 
 
-Parser::Parser() {
+/* character classes of the text stream */
+enum charClass {
+  /* the token classes come first */
+  CHAR_OTHER,
+  CHAR_DIGIT,
+  CHAR_SEPARATOR,
+  CHAR_NEWLINE
+};
+
+
+/* one table lookup per character instead of a chain of compares */
+namespace {
+struct CharClassTable {
+  unsigned char cls[256];
+  CharClassTable() {
+    for (int c = 0; c < 256; c++)
+      cls[c] = CHAR_OTHER;
+    for (int c = '0'; c <= '9'; c++)
+      cls[c] = CHAR_DIGIT;
+    cls[(unsigned char)'\t'] = CHAR_SEPARATOR;
+    cls[(unsigned char)' '] = CHAR_SEPARATOR;
+    cls[(unsigned char)';'] = CHAR_SEPARATOR;
+    /* CRLF line ends (e.g. a saved file edited elsewhere) */
+    cls[(unsigned char)'\r'] = CHAR_SEPARATOR;
+    cls[(unsigned char)'\n'] = CHAR_NEWLINE;
+  }
+};
+const CharClassTable charClasses;
+}
+
+/* 19 decimal digits always fit into 64 bit unsigned */
+#define MAX_DIGITS 19
+
+#define TEXT_LABEL_LEN ((int)sizeof(TEXT_LABEL) - 1)
+
 
+Parser::Parser() {
+  /* the text format does not carry the gate time */
+  PayloadFields::clear(mPayloadData);
+  mMalformedLines = 0;
+  mBatchLen = 0;
+  reset();
 }
 
 
@@ -37,122 +78,194 @@ Parser::~Parser()
 }
 
 
-/** Parser entry function */
+/** drop a partially received line */
+void
+Parser::reset(void){
+  mToken = 0;
+  mLabelLen = 0;
+  mInToken = false;
+  mSkipLine = false;
+  mValue = 0;
+  mDigits = 0;
+}
+
+
+/** Parser entry function
+ *
+ * Scans the buffer once. A line which is cut at the end of the buffer
+ * is continued with the next call. Returns -1 if a line of this buffer
+ * was malformed.
+ */
 int
 Parser::doParse(const char *stream, int len){
-  return (screener(stream, len));
+  const quint64 malformedBefore = mMalformedLines;
+  const unsigned char *p = (const unsigned char *)stream;
+  const unsigned char *end = p + len;
+
+  while (p < end){
+    const unsigned char ch = *p++;
+    switch (charClasses.cls[ch]){
+      case CHAR_DIGIT:
+        mInToken = true;
+        if ((mToken != 0) && (!mSkipLine)){
+          /* convert the whole run of digits at once */
+          quint64 value = 10*mValue + (ch - '0');
+          int digits = mDigits + 1;
+          while ((p < end) && (charClasses.cls[*p] == CHAR_DIGIT) &&
+                 (digits <= MAX_DIGITS)){
+            value = 10*value + (*p++ - '0');
+            digits++;
+          }
+          mValue = value;
+          mDigits = digits;
+          if (digits > MAX_DIGITS)
+            mSkipLine = true;
+          break;
+        }
+        /* the token is not converted */
+        /* fall through */
+      case CHAR_OTHER:
+        mInToken = true;
+        if ((mToken == 0) && (!mSkipLine)){
+          p = matchLabel(p - 1, end);
+          break;
+        }
+        mSkipLine = true;
+        while ((p < end) && (charClasses.cls[*p] <= CHAR_DIGIT))
+          p++;
+      break;
+      case CHAR_SEPARATOR:
+        if (mInToken)
+          endToken();
+      break;
+      case CHAR_NEWLINE:
+        if (mInToken)
+          endToken();
+        endLine();
+      break;
+    }
+  }
+  /* the records of this buffer are handed over at once */
+  flush();
+  return (mMalformedLines != malformedBefore) ? -1 : 0;
 }
 
 
-/** Handle separation characters. "\n" is handled as a token */
-int
-Parser::isASeparator(char ch){
-  return ((ch == '\t') | (ch == ' ') | (ch == ';'));
+/** Compare the label with TEXT_LABEL up to the end of the token or
+ *  of the buffer. the next buffer goes on where this one stopped
+ */
+const unsigned char *
+Parser::matchLabel(const unsigned char *p, const unsigned char *end){
+  /* the label is usually in one piece */
+  if ((mLabelLen == 0) && (end - p >= TEXT_LABEL_LEN) &&
+      (memcmp(p, TEXT_LABEL, TEXT_LABEL_LEN) == 0)){
+    mLabelLen = TEXT_LABEL_LEN;
+    p += TEXT_LABEL_LEN;
+  }
+  while ((p < end) && (charClasses.cls[*p] <= CHAR_DIGIT)){
+    if ((mLabelLen == TEXT_LABEL_LEN) || (*p != TEXT_LABEL[mLabelLen])){
+      mSkipLine = true;
+      break;
+    }
+    mLabelLen++;
+    p++;
+  }
+  while ((p < end) && (charClasses.cls[*p] <= CHAR_DIGIT))
+    p++;
+  return p;
 }
 
 
-/** Removes separators and converts the character stream into a character token stream */
-int
-Parser::screener(const char *stream, int len){
-  static int j = 0;
-  static char token[1024];
-  int err = 0;
- 
-  //qWarning() << "lexer input:" << stream;
-
-  for (int i = 0; i < len; i++){
-     if ( (!isASeparator(stream[i])) && stream[i] != '\n'){
-       /* must be start of a token - collect the token data */
-       token[j] = stream[i];
-       j++;
-     }else{
-       if ( stream[i] == '\n' ){
-         /* if there was no regular token before the '\n' separator ('\n' at the start of
-            the line or just before '\n' is a separator) then j == 0 and the tokenizer call
-            will return without any action */
-         token[j] = '\0';
-         if (tokenizer(token, j) < 0) 
-           err = -1;
-         j = 0;
-         /* inform the tokenizer about the '\n' new line (special token) to reset its
-            internal state machine (necessary if lets say a broken line is parsed) */
-         if (tokenizer(&stream[i], 1) < 0)
-           err = -1;
-       }else{
-         /* a regular token is completed and can be sent to the tokenizer or a separator
-            is found but then j==0 and a tokanizer call will return without any action */
-         token[j] = '\0';
-         if (tokenizer(token, j) < 0)
-           err = -1;
-         j = 0;
-       }
-     }
+/** A token is complete. store the converted value in its field */
+void
+Parser::endToken(void){
+  const quint64 value = mValue;
+
+  mInToken = false;
+  mValue = 0;
+  mDigits = 0;
+  if (mSkipLine)
+    return;
+  /* the label is not converted but must be complete. the columns fail
+     on too many tokens, too */
+  if (mToken == 0){
+    if (mLabelLen != TEXT_LABEL_LEN)
+      mSkipLine = true;
+  }else if (!TextColumns::store(mPayloadData, mToken - 1, value))
+    mSkipLine = true;
+  mToken++;
+}
+
+
+/** '\n' found. emit the line if it is complete and start over */
+void
+Parser::endLine(void){
+  if ((!mSkipLine) && (mToken > TEXT_COLUMNS_REQUIRED)){
+    mBatch[mBatchLen++] = mPayloadData;
+    if (mBatchLen == PAYLOAD_BATCH_MAX)
+      flush();
+    /* qWarning() << "CNT:" << mPayloadData.timerCounts
+               << "TIME:" << mPayloadData.kernelTime
+               << "ACCU:" << mPayloadData.accuCounts; */
+  }else if (mSkipLine || (mToken != 0)){
+    /* an empty line is no error */
+    mMalformedLines++;
   }
-  return err;
+  /* the optional columns of the next line */
+  TextColumns::clear(mPayloadData);
+  reset();
 }
 
 
-/** Identify, interpret and convert the tokens into the different data types (lexer) */
+/** Convert a record into the text line of the firmware
+ *
+ * Returns the length without '\0', 0 if the buffer is too small
+ */
 int
-Parser::tokenizer(const char *token, int len){
-  char * pEnd;
-  //qWarning() << "tokenizer input:" << token << "len:" << len;
-
-  if (len > 0){
-    /* check for end of line token '\n'. if there is a '\n' somewhere in the stream it is the
-       lexers responsibility to seperate the '\n'-token from the stream. we dont need
-       plausibility checks for '\n'-tokens within regular tokens */
-    if (token[0] != '\n'){
-      /* regular token (data-token or comment-token). parse the token */
-      switch (mTokenizerState){
-         case TOKENIZER_START:
-             /* presume start of a line. first token is a comment, can be everything */
-             mTokenizerState = TOKENIZER_GET_TIMERCOUNTS;
-         break;
-         case TOKENIZER_GET_TIMERCOUNTS:
-             mPayloadData.timerCounts = strtol(token, &pEnd, 10);
-             if ((pEnd - token) != len){
-               /* cant convert, ERROR_SYNOPSIS */
-               mTokenizerState = TOKENIZER_START;
-               return -1;
-             }else{
-               mTokenizerState = TOKENIZER_GET_KERNELTIME;
-             }
-         break;
-         case TOKENIZER_GET_KERNELTIME:
-             mPayloadData.kernelTime = strtol(token, &pEnd, 10);
-             if ((pEnd - token) != len){
-               /* cant convert, ERROR_SYNOPSIS */
-               mTokenizerState = TOKENIZER_START;
-               return -1;
-             }else{
-               mTokenizerState = TOKENIZER_GET_ACCUCOUNTS;
-             }
-         break;
-         case TOKENIZER_GET_ACCUCOUNTS:
-             mPayloadData.accuCounts = strtol(token, &pEnd, 10);
-             if ((pEnd - token) != len){
-               /* cant convert, ERROR_SYNOPSIS */
-               mTokenizerState = TOKENIZER_START;
-               return -1;
-             }else{
-                emit parserDataReady(&mPayloadData);
-                /* qWarning() << "CNT:" << mPayloadData.timerCounts
-                           << "TIME:" << mPayloadData.kernelTime
-                           << "ACCU:" << mPayloadData.accuCounts; */
-             }
-         break;
-         default:
-         break;
-      }
-    }else{
-      /* '\n'-token found, start over with new line, reset state machine */
-      tokenizerState stateOld = mTokenizerState;
-      mTokenizerState = TOKENIZER_START;
-      /* unplausible end of line */
-      if (!((stateOld == TOKENIZER_START) | (stateOld == TOKENIZER_GET_ACCUCOUNTS)))
-        return -1;
-    }
+Parser::encode(const payloadData *data, char *buf, int size){
+  int len = snprintf(buf, size, TEXT_LABEL);
+  if ((len < 0) || (len >= size))
+    return 0;
+  const int columns = TextColumns::format(*data, buf + len, size - len,
+                                          TEXT_COLUMNS_REQUIRED, " ; ");
+  if (columns < 0)
+    return 0;
+  len += columns;
+  if (len + 1 >= size)
+    return 0;
+  buf[len++] = '\n';
+  buf[len] = '\0';
+  return len;
+}
+
+
+/** Convert a record into a line of the saved CSV files, all columns
+ *
+ * Returns the length without '\0', 0 if the buffer is too small
+ */
+int
+Parser::encodeCsv(int lineNumber, const payloadData *data, char *buf, int size){
+  int len = snprintf(buf, size, "%d", lineNumber);
+  if ((len < 0) || (len >= size))
+    return 0;
+  const int columns = PayloadFields::format(*data, buf + len, size - len,
+                                            PayloadFields::size, CSV_SEPARATOR);
+  if (columns < 0)
+    return 0;
+  len += columns;
+  if (len + 1 >= size)
+    return 0;
+  buf[len++] = '\n';
+  buf[len] = '\0';
+  return len;
+}
+
+
+/** Hand over the collected records */
+void
+Parser::flush(void){
+  if (mBatchLen > 0){
+    emit parserDataReady(mBatch, mBatchLen);
+    mBatchLen = 0;
   }
-  return 0;
 }
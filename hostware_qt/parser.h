@@ -26,25 +26,19 @@
 #define PARSER_H_
 
 #include <QObject>
+#include "schema.h"
 
 
-enum tokenizerState {
-  TOKENIZER_START,
-  TOKENIZER_GET_TIMERCOUNTS,
-  TOKENIZER_GET_KERNELTIME,
-  TOKENIZER_GET_ACCUCOUNTS
+/** payload data which is sent over the character device. the
+    members are generated from the schema (schema.h) */
+class payloadData : public FieldRecord<PAYLOAD_FIELDS>
+{
 };
 
 
-/** payload data which is sent over the character device */
-class payloadData
-{
-  public:
-    int timerCounts;
-    int kernelTime;
-    int accuCounts;
-  private:
-};
+/** number of records handed over with one parserDataReady(). a read
+    buffer with more records is handed over in several batches */
+#define PAYLOAD_BATCH_MAX 256
 
 
 /* we need the QObject to implement signals and slots */
@@ -56,19 +50,43 @@ public:
     explicit Parser ();
     ~Parser ();
     int doParse(const char *stream, int len);
+    void reset(void);
+    /* the text line of the firmware for a record, see TextColumns */
+    static int encode(const payloadData *data, char *buf, int size);
+    /* a line of the saved CSV files, see CSV_SEPARATOR */
+    static int encodeCsv(int lineNumber, const payloadData *data, char *buf,
+                         int size);
+    /* lines which were dropped because they could not be converted */
+    quint64 malformedLines(void) const { return mMalformedLines; }
 
 signals:
-   void parserDataReady(const payloadData *data);
+   /* count > 0 records in the order of the stream. valid during the
+      call only */
+   void parserDataReady(const payloadData *data, int count);
 
 public slots:
 
 
 private:
-   int screener(const char *stream, int len);
-   int isASeparator(char ch);
-   int tokenizer(const char *token, int len);
+   void endToken(void);
+   void endLine(void);
+   void flush(void);
+   const unsigned char *matchLabel(const unsigned char *p,
+                                   const unsigned char *end);
    payloadData mPayloadData;
-   tokenizerState mTokenizerState = TOKENIZER_START;
+   payloadData mBatch[PAYLOAD_BATCH_MAX];
+   int mBatchLen;
+   /* state of the line which is cut at the end of a read buffer. the
+      token is not copied, its digits are converted on the fly. mToken
+      counts the tokens of the line, the first one is the label.
+      mLabelLen bytes of it matched TEXT_LABEL so far */
+   int mToken;
+   int mLabelLen;
+   bool mInToken;
+   bool mSkipLine;
+   quint64 mValue;
+   int mDigits;
+   quint64 mMalformedLines;
 };
 
 #endif
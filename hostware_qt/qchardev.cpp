@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <QtCore/QDebug>
 #include <QtCore/QReadLocker>
 #include <QtCore/QWriteLocker>
@@ -39,6 +40,9 @@ QcharDev::QcharDev(QObject *parent)
 {
     fd = 0;
     readNotifier = 0;
+    readerCtrl = 0;
+    ringCtrl = 0;
+    ringData = 0;
 }
 
 
@@ -81,6 +85,60 @@ qint64 QcharDev::setTimerCountsPerSample(unsigned int *cps)
 }
 
 
+/** select text or binary records (enum OUTPUT_FORMATS). fails on
+    firmware without binary support */
+qint64 QcharDev::setOutputFormat(unsigned int format)
+{
+    int retVal = -1;
+
+    if (isOpen()) {
+        retVal = ::ioctl(fd, IOCTL_SET_OUTPUT_FORMAT, &format);
+    }
+
+    return retVal;
+}
+
+
+/** timer period (PERIOD_NS_MIN ... PERIOD_NS_MAX). a sample lasts
+    periodNs * timer counts per sample */
+qint64 QcharDev::setPeriodNs(quint64 periodNs)
+{
+    int retVal = -1;
+
+    if (isOpen()) {
+        retVal = ::ioctl(fd, IOCTL_SET_PERIOD_NS, &periodNs);
+    }
+
+    return retVal;
+}
+
+
+/** timer period and whether a measurement is running */
+qint64 QcharDev::getTimebase(timebase_status_t *status)
+{
+    int retVal = -1;
+
+    if (isOpen()) {
+        retVal = ::ioctl(fd, IOCTL_GET_TIMEBASE, status);
+    }
+
+    return retVal;
+}
+
+
+/** counts of the sample which is not finished yet */
+qint64 QcharDev::getLiveSnapshot(live_snapshot_t *live)
+{
+    int retVal = -1;
+
+    if (isOpen()) {
+        retVal = ::ioctl(fd, IOCTL_GET_LIVE, live);
+    }
+
+    return retVal;
+}
+
+
 void QcharDev::_q_canRead()
 {
     //qWarning() << "emit readyread() ";
@@ -88,11 +146,61 @@ void QcharDev::_q_canRead()
 }
 
 
+/** map the record ring. our cursor page is writable (consumer index),
+    the ring header and the records are shared by all readers and read only */
+bool QcharDev::mapRing(void)
+{
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    void *cursor = ::mmap(NULL, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cursor == MAP_FAILED)
+        return false;
+    void *ctrl = ::mmap(NULL, pageSize, PROT_READ, MAP_SHARED, fd, pageSize);
+    if (ctrl != MAP_FAILED) {
+        ringCtrl = static_cast<const ring_ctrl_t *>(ctrl);
+        if ((ringCtrl->version == RING_VERSION) &&
+            (ringCtrl->record_size == sizeof(sample_record_t))) {
+            void *data = ::mmap(NULL, ringCtrl->capacity * ringCtrl->record_size,
+                                PROT_READ, MAP_SHARED, fd, ringCtrl->data_offset);
+            if (data != MAP_FAILED) {
+                readerCtrl = static_cast<reader_ctrl_t *>(cursor);
+                ringData = static_cast<const sample_record_t *>(data);
+                return true;
+            }
+        }
+        ::munmap(ctrl, pageSize);
+        ringCtrl = 0;
+    }
+    ::munmap(cursor, pageSize);
+    return false;
+}
+
+
+void QcharDev::unmapRing(void)
+{
+    if (ringCtrl) {
+        const long pageSize = sysconf(_SC_PAGESIZE);
+        ::munmap(const_cast<sample_record_t *>(ringData),
+                 ringCtrl->capacity * ringCtrl->record_size);
+        ::munmap(const_cast<ring_ctrl_t *>(ringCtrl), pageSize);
+        ::munmap(readerCtrl, pageSize);
+        readerCtrl = 0;
+        ringCtrl = 0;
+        ringData = 0;
+    }
+}
+
+
 bool QcharDev::open(OpenMode mode)
 {
     if ((mode & QIODevice::ReadOnly) && !isOpen()) {
-        if ((fd = ::open(QString("/dev/" DEVICE_NAME).toLatin1() ,O_RDONLY)) != -1) {
+        /* read/write access is needed to map the consumer index */
+        fd = ::open(QString("/dev/" DEVICE_NAME).toLatin1(), O_RDWR);
+        if (fd == -1)
+            fd = ::open(QString("/dev/" DEVICE_NAME).toLatin1(), O_RDONLY);
+        if (fd != -1) {
             setOpenMode(mode);
+            if (!mapRing())
+                qWarning() << "cannot map the record ring, using read()";
 
             readNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
             connect(readNotifier, SIGNAL(activated(int)), this, SLOT(_q_canRead()));
@@ -107,6 +215,7 @@ void QcharDev::close()
 {
     if (isOpen()) {
         QIODevice::close(); // mark ourselves as closed
+        unmapRing();
         ::close(fd);
         if (readNotifier) {
             delete readNotifier;
@@ -136,11 +245,25 @@ qint64 QcharDev::writeData(const char *data, qint64 maxSize)
 }
 
 
+/** true if the records are taken from the shared ring. readAll() then
+    returns binary records regardless of the output format */
+bool QcharDev::isMapped(void) const
+{
+    return ringCtrl != 0;
+}
+
+
 qint64 QcharDev::bytesAvailable() const
 {
     int retVal = -1;
     qint64 len = 0;
 
+    if (ringCtrl) {
+        /* no syscall */
+        const quint32 head = __atomic_load_n(&ringCtrl->head, __ATOMIC_ACQUIRE);
+        const quint32 fill = qMin(head - readerCtrl->tail, ringCtrl->capacity);
+        return (qint64)fill * sizeof(sample_record_t);
+    }
     if (isOpen()) {
         retVal = ::ioctl(fd, IOCTL_GET_FIFO_LEN, len);
     }
@@ -151,6 +274,30 @@ qint64 QcharDev::bytesAvailable() const
 
 QByteArray QcharDev::readAll()
 {
+    if (ringCtrl) {
+        /* copy the records straight from the mapping. records the firmware
+           overwrote before or while we copied them are skipped */
+        const quint32 head = __atomic_load_n(&ringCtrl->head, __ATOMIC_ACQUIRE);
+        const quint32 capacity = ringCtrl->capacity;
+        const quint32 mask = capacity - 1;
+        quint32 tail = readerCtrl->tail;
+        if (head - tail > capacity)
+            tail = head - capacity;
+        QByteArray records;
+        records.reserve((head - tail) * sizeof(sample_record_t));
+        for (; tail != head; tail++) {
+            records.append(reinterpret_cast<const char *>(&ringData[tail & mask]),
+                           sizeof(sample_record_t));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&ringCtrl->head, __ATOMIC_RELAXED) - tail >= capacity)
+                records.chop(sizeof(sample_record_t));
+        }
+        /* publish our cursor. the firmware decides by it when poll()
+           reports readable (watermark and latency wakeups), a stale
+           tail means readyRead() for records we have already */
+        __atomic_store_n(&readerCtrl->tail, tail, __ATOMIC_RELEASE);
+        return records;
+    }
     int avail = this->bytesAvailable();
     return (avail > 0) ? this->read(avail) : QByteArray();
 }
@@ -27,6 +27,7 @@
 
 #include <QtCore/QtGlobal>
 #include <QtCore/QIODevice>
+#include "common_defs.h"
 
 class QSocketNotifier;
 
@@ -41,7 +42,12 @@ public:
     qint64 stopMsrmnt(void);
     qint64 startMsrmnt(void);
     qint64 setTimerCountsPerSample(unsigned int *cps);
+    qint64 setOutputFormat(unsigned int format);
+    qint64 setPeriodNs(quint64 periodNs);
+    qint64 getTimebase(timebase_status_t *status);
+    qint64 getLiveSnapshot(live_snapshot_t *live);
     qint64 bytesAvailable() const;
+    bool isMapped(void) const;
     QByteArray readAll();
     bool open(OpenMode mode);
     void close();
@@ -49,6 +55,12 @@ public:
 private:
     int fd;
     QSocketNotifier *readNotifier;
+    /* record ring shared with the firmware (0 if read() is used) */
+    reader_ctrl_t *readerCtrl;
+    const ring_ctrl_t *ringCtrl;
+    const sample_record_t *ringData;
+    bool mapRing(void);
+    void unmapRing(void);
 
 protected:
     qint64 readData(char *data, qint64 maxSize);
@@ -0,0 +1,156 @@
+/** \file schema.h
+* \brief Compile time schema of the records delivered by the firmware
+*
+* \author Copyright (C) 2014 samplemaker
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2.1
+* of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free
+* Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+* Boston, MA 02110-1301 USA
+*
+* A new record field is one RECORD_FIELD() line plus its place in
+* PayloadFields and, if the text output carries it, in TextColumns.
+* The payload layout, the text parser, the text and CSV encoders and the
+* binary decoder and encoder follow from the lists. Everything is resolved at compile
+* time, the loops over the fields are unrolled by the compiler.
+*
+* @{
+*/
+
+
+#ifndef SCHEMA_H_
+#define SCHEMA_H_
+
+#include <QtGlobal>
+#include <limits>
+#include <stdio.h>
+#include "common_defs.h"
+
+
+/** Declare a field: its tag, C type (the width), member name, how it
+    is taken from a binary record and how it is put into one (value v).
+    the tag holds the member, a payload inherits all tags and keeps the
+    plain member names */
+#define RECORD_FIELD(tag, T, member, fromRecord, toRecord)             \
+  struct tag {                                                         \
+    typedef T type;                                                    \
+    T member;                                                          \
+    static T &ref(tag &f) { return f.member; }                         \
+    static const T &ref(const tag &f) { return f.member; }             \
+    static T decode(const sample_record_t &r) { return (fromRecord); } \
+    static void encode(sample_record_t &r, T v) { toRecord; }          \
+  }
+
+RECORD_FIELD(FieldTimerCounts, qint64, timerCounts, r.sequence, r.sequence = v);
+RECORD_FIELD(FieldKernelTime, qint64, kernelTime, r.time_ns / 1000000,
+             r.time_ns = v * 1000000);
+RECORD_FIELD(FieldAccuCounts, int, accuCounts, r.accu_counts, r.accu_counts = v);
+/* measured sample length in ns, 0 if unknown (text format) */
+RECORD_FIELD(FieldGateNs, qint64, gateNs, r.gate_ns, r.gate_ns = v);
+RECORD_FIELD(FieldMissedPeriods, int, missedPeriods, r.missed_periods,
+             r.missed_periods = v);
+/* channels masked by the interrupt storm protection (bits) */
+RECORD_FIELD(FieldSaturatedChannels, int, saturatedChannels, r.saturated_channels,
+             r.saturated_channels = v);
+/* absolute ns of the wall clock at the sample boundary, 0 if off */
+RECORD_FIELD(FieldWallNs, qint64, wallNs, r.wall_ns, r.wall_ns = v);
+
+
+/** Operations on a list of fields, unrolled at compile time. R is a
+    payload which contains all fields of the list */
+template<class... Fields> struct FieldList;
+
+template<> struct FieldList<> {
+  enum { size = 0 };
+  template<class R> static void clear(R &) {}
+  template<class R> static void decode(R &, const sample_record_t &) {}
+  template<class R> static void encode(const R &, sample_record_t &) {}
+  template<class R> static bool store(R &, int, quint64) { return false; }
+  template<class R> static int format(const R &, char *, int, int,
+                                      const char *) { return 0; }
+};
+
+template<class F, class... Rest> struct FieldList<F, Rest...> {
+  typedef FieldList<Rest...> Next;
+  enum { size = 1 + Next::size };
+
+  /** zero all fields */
+  template<class R> static void clear(R &r) {
+    F::ref(r) = 0;
+    Next::clear(r);
+  }
+
+  /** take all fields from a binary record */
+  template<class R> static void decode(R &r, const sample_record_t &rec) {
+    F::ref(r) = F::decode(rec);
+    Next::decode(r, rec);
+  }
+
+  /** put all fields into a binary record */
+  template<class R> static void encode(const R &r, sample_record_t &rec) {
+    F::encode(rec, F::ref(r));
+    Next::encode(r, rec);
+  }
+
+  /** store a converted text column. false if there is no such column
+      or the value does not fit into the field */
+  template<class R> static bool store(R &r, int column, quint64 value) {
+    if (column != 0)
+      return Next::store(r, column - 1, value);
+    if (value > (quint64)std::numeric_limits<typename F::type>::max())
+      return false;
+    F::ref(r) = value;
+    return true;
+  }
+
+  /** append separator and value per column. the columns behind the
+      first required ones are left out if they are 0. returns the
+      length, -1 if the buffer is too small */
+  template<class R> static int format(const R &r, char *buf, int size,
+                                      int required, const char *separator) {
+    int len = 0;
+    if ((required > 0) || (F::ref(r) != 0)){
+      len = snprintf(buf, size, "%s%lld", separator, (long long)F::ref(r));
+      if ((len < 0) || (len >= size))
+        return -1;
+    }
+    const int rest = Next::format(r, buf + len, size - len, required - 1,
+                                  separator);
+    return (rest < 0) ? -1 : len + rest;
+  }
+};
+
+
+/** a payload with the members of all fields of the list */
+template<class... Fields> struct FieldRecord : Fields... {};
+
+
+/** all fields the hostware knows */
+#define PAYLOAD_FIELDS FieldTimerCounts, FieldKernelTime, FieldAccuCounts, \
+                       FieldGateNs, FieldMissedPeriods,                    \
+                       FieldSaturatedChannels, FieldWallNs
+typedef FieldList<PAYLOAD_FIELDS> PayloadFields;
+
+/** separator of the saved CSV files "n;timerCounts;kernelTime;...".
+    the columns are PayloadFields in their order behind the line number */
+#define CSV_SEPARATOR ";"
+
+/** columns of a text line behind its label
+    "event/time/count: ; a ; b ; c [; d]\n" in their order. the first
+    TEXT_COLUMNS_REQUIRED are always there */
+typedef FieldList<FieldTimerCounts, FieldKernelTime, FieldAccuCounts,
+                  FieldWallNs> TextColumns;
+#define TEXT_COLUMNS_REQUIRED 3
+#define TEXT_LABEL "event/time/count:"
+
+#endif
@@ -0,0 +1,170 @@
+/** \file spscring.h
+* \brief Lock free ring of records for one producer and one consumer
+*
+* \author Copyright (C) 2014 samplemaker
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2.1
+* of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free
+* Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+* Boston, MA 02110-1301 USA
+*
+* Same scheme as the record ring of the firmware: head and tail are
+* free running indices, element i lives at i & (Capacity - 1). The
+* producer never waits, it overwrites the oldest elements. The
+* consumer copies and checks afterwards that the producer did not
+* overwrite what it copied: element i is intact if head - i < Capacity
+* still holds. Hence Capacity - 1 elements are readable.
+*
+* The copy which races with an overwrite is made on purpose (as the
+* readers of a seqlock do), hence a slot is a row of atomic words which
+* are stored and loaded relaxed. A torn copy is well defined, detected
+* and dropped. T must be trivially copyable.
+*
+* @{
+*/
+
+
+#ifndef SPSCRING_H_
+#define SPSCRING_H_
+
+#include <atomic>
+#include <type_traits>
+#include <string.h>
+
+/** keeps the indices of producer and consumer apart. a ring on the
+    heap needs an allocator which honours the alignment (C++17 new) */
+#define SPSC_CACHE_LINE 64
+
+
+template<class T, unsigned int Capacity>
+class SpscRing
+{
+    static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0),
+                  "capacity must be a power of 2");
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "elements are copied as words");
+
+public:
+    SpscRing() : mHead(0), mTail(0), mLost(0) {}
+
+    /** number of elements copyLastN() can deliver at most */
+    static unsigned int capacity(void) { return Capacity - 1; }
+
+    /** producer: append n elements, the oldest are overwritten */
+    void push(const T *elems, unsigned int n) {
+        unsigned int head = mHead.load(std::memory_order_relaxed);
+        for (unsigned int i = 0; i < n; i++){
+            /* the last index must be visible before the slot of the
+               oldest element is overwritten */
+            std::atomic_thread_fence(std::memory_order_release);
+            store(mData[head & (Capacity - 1)], elems[i]);
+            /* the element must be visible before the index */
+            mHead.store(++head, std::memory_order_release);
+        }
+    }
+
+    /** consumer: copy the newest N (or max available) elements in
+        their order without removing them. returns the number copied */
+    unsigned int copyLastN(unsigned int N, T *elems) const {
+        const unsigned int head = mHead.load(std::memory_order_acquire);
+        unsigned int n = (N < capacity()) ? N : capacity();
+        if (n > head)
+            n = head;
+        const unsigned int first = head - n;
+        for (unsigned int i = 0; i < n; i++)
+            load(mData[(first + i) & (Capacity - 1)], elems[i]);
+        /* drop the oldest ones if they were overwritten meanwhile */
+        const unsigned int bad = overwritten(first);
+        if (bad >= n)
+            return 0;
+        if (bad > 0)
+            memmove(elems, elems + bad, (n - bad) * sizeof(T));
+        return n - bad;
+    }
+
+    /** consumer: remove up to N elements in their order. elements the
+        producer overwrote before they were removed are counted in
+        lost(). returns the number removed */
+    unsigned int pop(unsigned int N, T *elems) {
+        const unsigned int head = mHead.load(std::memory_order_acquire);
+        unsigned int tail = mTail.load(std::memory_order_relaxed);
+        if (head - tail > capacity()){
+            mLost += head - tail - capacity();
+            tail = head - capacity();
+        }
+        unsigned int n = head - tail;
+        if (n > N)
+            n = N;
+        for (unsigned int i = 0; i < n; i++)
+            load(mData[(tail + i) & (Capacity - 1)], elems[i]);
+        unsigned int bad = overwritten(tail);
+        if (bad > n)
+            bad = n;
+        if (bad > 0)
+            memmove(elems, elems + bad, (n - bad) * sizeof(T));
+        mLost += bad;
+        mTail.store(tail + n, std::memory_order_release);
+        return n - bad;
+    }
+
+    /** elements the consumer lost in pop() */
+    unsigned long long lost(void) const { return mLost; }
+
+    /** empty the ring. neither producer nor consumer may run */
+    void reset(void) {
+        mHead.store(0, std::memory_order_relaxed);
+        mTail.store(0, std::memory_order_relaxed);
+        mLost = 0;
+    }
+
+private:
+    typedef unsigned int Word;
+    enum { Words = (sizeof(T) + sizeof(Word) - 1) / sizeof(Word) };
+    struct Slot {
+        std::atomic<Word> w[Words];
+    };
+
+    static void store(Slot &slot, const T &elem) {
+        Word buf[Words];
+        buf[Words - 1] = 0;
+        memcpy(buf, &elem, sizeof(T));
+        for (int i = 0; i < Words; i++)
+            slot.w[i].store(buf[i], std::memory_order_relaxed);
+    }
+
+    static void load(const Slot &slot, T &elem) {
+        Word buf[Words];
+        for (int i = 0; i < Words; i++)
+            buf[i] = slot.w[i].load(std::memory_order_relaxed);
+        memcpy(&elem, buf, sizeof(T));
+    }
+
+    /** number of elements from index first on which were (possibly)
+        overwritten while they were copied */
+    unsigned int overwritten(unsigned int first) const {
+        /* finish the copy before the index is read */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const int bad = (int)(mHead.load(std::memory_order_relaxed)
+                              - Capacity + 1 - first);
+        return (bad > 0) ? bad : 0;
+    }
+
+    /* written by the producer only */
+    alignas(SPSC_CACHE_LINE) std::atomic<unsigned int> mHead;
+    /* written by the consumer only */
+    alignas(SPSC_CACHE_LINE) std::atomic<unsigned int> mTail;
+    unsigned long long mLost;
+    alignas(SPSC_CACHE_LINE) Slot mData[Capacity];
+};
+
+#endif
@@ -0,0 +1,16 @@
+# unit tests of the hostware logic which needs no device.
+# qmake-qt5 tests.pro && make check
+QT += testlib
+QT -= gui
+CONFIG += testcase console thread
+QMAKE_CXXFLAGS += -std=c++11
+
+TEMPLATE = app
+TARGET = tst_hostware
+INCLUDEPATH += ../ ../../include/
+
+HEADERS += ../decoder.h ../history.h ../parser.h ../spscring.h
+SOURCES += ../decoder.cpp \
+           ../history.cpp \
+           ../parser.cpp \
+           tst_hostware.cpp
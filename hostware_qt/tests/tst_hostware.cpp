@@ -0,0 +1,633 @@
+/** \file tst_hostware.cpp
+* \brief Unit tests of the hostware logic which needs no device
+*
+* \author Copyright (C) 2014 samplemaker
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public License
+* as published by the Free Software Foundation; either version 2.1
+* of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free
+* Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+* Boston, MA 02110-1301 USA
+*
+* @{
+*/
+
+
+#include <QtTest/QtTest>
+#include <QVector>
+#include <string.h>
+#include <thread>
+#include "parser.h"
+#include "decoder.h"
+#include "spscring.h"
+#include "history.h"
+
+
+/* the records of all batches a parser hands over */
+class Collector
+{
+public:
+    template<class Source> explicit Collector(Source *source) {
+        QObject::connect(source, &Source::parserDataReady,
+                         [this](const payloadData *data, int count){
+                             batches++;
+                             for (int i = 0; i < count; i++)
+                                 records.append(data[i]);
+                         });
+    }
+    QVector<payloadData> records;
+    int batches = 0;
+};
+
+
+class TestHostware : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void parserLine();
+    void parserSplitLine();
+    void parserOverflow();
+    void parserWallColumn();
+    void parserLabel();
+    void parserCrLf();
+    void parserBatches();
+    void decoderBatches();
+    void decoderSplitRecord();
+    void decoderSkipUnknown();
+    void textRoundTrip();
+    void binaryRoundTrip();
+    void csvLine();
+    void ringCopyLastN();
+    void ringLost();
+    void ringThreads();
+    void historyBoundaries();
+    void historyFold();
+    void historyBounded();
+};
+
+
+static int
+parseString(Parser &parser, const char *text){
+    return parser.doParse(text, strlen(text));
+}
+
+
+void
+TestHostware::parserLine(){
+    Parser parser;
+    Collector c(&parser);
+
+    QCOMPARE(parseString(parser, "event/time/count: ; 7 ; 1000 ; 42\n"), 0);
+    QCOMPARE(c.records.size(), 1);
+    QCOMPARE(c.records[0].timerCounts, 7LL);
+    QCOMPARE(c.records[0].kernelTime, 1000LL);
+    QCOMPARE(c.records[0].accuCounts, 42);
+    QCOMPARE(c.records[0].wallNs, 0LL);
+    QCOMPARE(parser.malformedLines(), 0ULL);
+}
+
+
+/* a line which is cut at any place by the end of a read buffer */
+void
+TestHostware::parserSplitLine(){
+    const char *text = "event/time/count: ; 12345 ; 678 ; 9\n"
+                       "event/time/count: ; 12346 ; 1678 ; 10 ; 1400000000123456789\n";
+    const int len = strlen(text);
+
+    for (int cut = 0; cut <= len; cut++){
+        Parser parser;
+        Collector c(&parser);
+        QCOMPARE(parser.doParse(text, cut), 0);
+        QCOMPARE(parser.doParse(text + cut, len - cut), 0);
+        QCOMPARE(c.records.size(), 2);
+        QCOMPARE(c.records[0].timerCounts, 12345LL);
+        QCOMPARE(c.records[0].kernelTime, 678LL);
+        QCOMPARE(c.records[0].accuCounts, 9);
+        QCOMPARE(c.records[1].accuCounts, 10);
+        QCOMPARE(c.records[1].wallNs, 1400000000123456789LL);
+        QCOMPARE(parser.malformedLines(), 0ULL);
+    }
+}
+
+
+/* a value which does not fit into its field drops the line */
+void
+TestHostware::parserOverflow(){
+    Parser parser;
+    Collector c(&parser);
+
+    /* accuCounts is an int */
+    QCOMPARE(parseString(parser, "event/time/count: ; 1 ; 2 ; 2147483648\n"), -1);
+    /* more digits than 64 bit hold */
+    QCOMPARE(parseString(parser, "event/time/count: ; 123456789012345678901 ; 2 ; 3\n"), -1);
+    QCOMPARE(parser.malformedLines(), 2ULL);
+    QCOMPARE(c.records.size(), 0);
+    /* the next line is fine again */
+    QCOMPARE(parseString(parser, "event/time/count: ; 1 ; 2 ; 2147483647\n"), 0);
+    QCOMPARE(c.records.size(), 1);
+    QCOMPARE(c.records[0].accuCounts, 2147483647);
+}
+
+
+/* the wall clock column is optional and does not stick to the next
+   line */
+void
+TestHostware::parserWallColumn(){
+    Parser parser;
+    Collector c(&parser);
+
+    QCOMPARE(parseString(parser, "event/time/count: ; 1 ; 1000 ; 5 ; 99\n"
+                                 "event/time/count: ; 2 ; 2000 ; 6\n"), 0);
+    QCOMPARE(c.records.size(), 2);
+    QCOMPARE(c.records[0].wallNs, 99LL);
+    QCOMPARE(c.records[1].wallNs, 0LL);
+    /* no column behind the wall clock */
+    QCOMPARE(parseString(parser, "event/time/count: ; 1 ; 2 ; 3 ; 4 ; 5\n"), -1);
+    /* the required ones are there */
+    QCOMPARE(parseString(parser, "event/time/count: ; 1 ; 2\n"), -1);
+    QCOMPARE(c.records.size(), 2);
+    QCOMPARE(parser.malformedLines(), 2ULL);
+}
+
+
+void
+TestHostware::parserLabel(){
+    Parser parser;
+    Collector c(&parser);
+
+    QCOMPARE(parseString(parser, "foo ; 1 ; 2 ; 3\n"), -1);
+    QCOMPARE(parseString(parser, "event/time/count ; 1 ; 2 ; 3\n"), -1);
+    QCOMPARE(parseString(parser, "event/time/count:x ; 1 ; 2 ; 3\n"), -1);
+    QCOMPARE(parseString(parser, "1 ; 1 ; 2 ; 3\n"), -1);
+    QCOMPARE(parser.malformedLines(), 4ULL);
+    /* an empty line is no error */
+    QCOMPARE(parseString(parser, "\n \n"), 0);
+    /* the label is cut by the end of the buffer */
+    QCOMPARE(parseString(parser, "event/ti"), 0);
+    QCOMPARE(parseString(parser, "me/count: ; 1 ; 2 ; 3\n"), 0);
+    QCOMPARE(c.records.size(), 1);
+    QCOMPARE(parser.malformedLines(), 4ULL);
+}
+
+
+void
+TestHostware::parserCrLf(){
+    Parser parser;
+    Collector c(&parser);
+
+    QCOMPARE(parseString(parser, "event/time/count: ; 1 ; 2 ; 3\r\n"
+                                 "event/time/count: ; 4 ; 5 ; 6 ; 7\r\n"), 0);
+    QCOMPARE(c.records.size(), 2);
+    QCOMPARE(c.records[0].accuCounts, 3);
+    QCOMPARE(c.records[1].wallNs, 7LL);
+}
+
+
+/* a read buffer with more than PAYLOAD_BATCH_MAX lines is handed over
+   in several batches, a partial batch at the end of the buffer */
+void
+TestHostware::parserBatches(){
+    Parser parser;
+    Collector c(&parser);
+    const int lines = 2*PAYLOAD_BATCH_MAX + 10;
+    QByteArray text;
+
+    for (int i = 0; i < lines; i++)
+        text += QByteArray("event/time/count: ; ") + QByteArray::number(i) +
+                " ; " + QByteArray::number(1000*i) + " ; 1\n";
+    QCOMPARE(parser.doParse(text.constData(), text.size()), 0);
+    QCOMPARE(c.batches, 3);
+    QCOMPARE(c.records.size(), lines);
+    for (int i = 0; i < lines; i++)
+        QCOMPARE(c.records[i].timerCounts, (qint64)i);
+}
+
+
+static sample_record_t
+makeRecord(quint64 sequence){
+    sample_record_t rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.version = RECORD_VERSION;
+    rec.length = sizeof(sample_record_t);
+    rec.sequence = sequence;
+    rec.time_ns = sequence * 1000000000ULL;
+    rec.accu_counts = sequence % 100;
+    rec.gate_ns = 1000000000ULL;
+    rec.saturated_channels = (sequence == 3) ? 1 : 0;
+    rec.wall_ns = 1400000000000000000ULL + rec.time_ns;
+    return rec;
+}
+
+
+void
+TestHostware::decoderBatches(){
+    Decoder decoder;
+    Collector c(&decoder);
+    const int records = 2*PAYLOAD_BATCH_MAX + 10;
+    QVector<sample_record_t> stream;
+
+    for (int i = 0; i < records; i++)
+        stream.append(makeRecord(i));
+    QCOMPARE(decoder.doDecode((const char *)stream.data(),
+                              records * sizeof(sample_record_t)), 0);
+    QCOMPARE(c.batches, 3);
+    QCOMPARE(c.records.size(), records);
+    for (int i = 0; i < records; i++){
+        QCOMPARE(c.records[i].timerCounts, (qint64)i);
+        QCOMPARE(c.records[i].kernelTime, 1000LL * i);
+        QCOMPARE(c.records[i].accuCounts, i % 100);
+        QCOMPARE(c.records[i].gateNs, 1000000000LL);
+        QCOMPARE(c.records[i].saturatedChannels, (i == 3) ? 1 : 0);
+        QCOMPARE(c.records[i].wallNs, 1400000000000000000LL + 1000000000LL * i);
+    }
+}
+
+
+/* a record cut at any place, and a record of another layout */
+void
+TestHostware::decoderSplitRecord(){
+    sample_record_t stream[3] = { makeRecord(1), makeRecord(2), makeRecord(3) };
+    const int len = sizeof(stream);
+
+    for (int cut = 0; cut <= len; cut++){
+        Decoder decoder;
+        Collector c(&decoder);
+        QCOMPARE(decoder.doDecode((const char *)stream, cut), 0);
+        QCOMPARE(decoder.doDecode((const char *)stream + cut, len - cut), 0);
+        QCOMPARE(c.records.size(), 3);
+        QCOMPARE(c.records[2].timerCounts, 3LL);
+    }
+
+    Decoder decoder;
+    Collector c(&decoder);
+    stream[1].version = RECORD_VERSION + 1;
+    QCOMPARE(decoder.doDecode((const char *)stream, len), -1);
+    QCOMPARE(c.records.size(), 2);
+    QCOMPARE(c.records[1].timerCounts, 3LL);
+}
+
+
+/* records of other layouts are skipped by their length, a garbage
+   length costs one record of ours */
+void
+TestHostware::decoderSkipUnknown(){
+    const int recLen = sizeof(sample_record_t);
+    char stream[6 * sizeof(sample_record_t)];
+    int len = 0;
+    sample_record_t rec;
+
+    rec = makeRecord(1);
+    memcpy(&stream[len], &rec, recLen);
+    len += recLen;
+    /* longer than ours */
+    memset(&stream[len], 0x55, recLen + 16);
+    rec.version = RECORD_VERSION + 1;
+    rec.length = recLen + 16;
+    memcpy(&stream[len], &rec, 4);
+    len += recLen + 16;
+    /* shorter than ours */
+    memset(&stream[len], 0xaa, 8);
+    rec.length = 8;
+    memcpy(&stream[len], &rec, 4);
+    len += 8;
+    rec = makeRecord(2);
+    memcpy(&stream[len], &rec, recLen);
+    len += recLen;
+    /* garbage */
+    memset(&stream[len], 0xff, recLen);
+    rec.length = 2;
+    memcpy(&stream[len], &rec, 4);
+    len += recLen;
+    rec = makeRecord(3);
+    memcpy(&stream[len], &rec, recLen);
+    len += recLen;
+
+    for (int cut = 0; cut <= len; cut++){
+        Decoder decoder;
+        Collector c(&decoder);
+        const int err = decoder.doDecode(stream, cut) +
+                        decoder.doDecode(stream + cut, len - cut);
+        QVERIFY(err < 0);
+        QCOMPARE(c.records.size(), 3);
+        for (int i = 0; i < 3; i++)
+            QCOMPARE(c.records[i].timerCounts, (qint64)(i + 1));
+    }
+}
+
+
+static payloadData
+makePayload(int i){
+    payloadData data;
+
+    PayloadFields::clear(data);
+    data.timerCounts = i;
+    data.kernelTime = 1000LL * i;
+    data.accuCounts = 2147483647 - i;
+    data.gateNs = 999999937LL + i;
+    data.missedPeriods = i % 3;
+    data.saturatedChannels = i % 2;
+    data.wallNs = (i % 2) ? 0 : 1400000000000000000LL + i;
+    return data;
+}
+
+
+/* the text columns survive Parser::encode() and doParse() */
+void
+TestHostware::textRoundTrip(){
+    Parser parser;
+    Collector c(&parser);
+    QByteArray text;
+
+    for (int i = 0; i < 10; i++){
+        const payloadData data = makePayload(i);
+        char line[128];
+        QVERIFY(Parser::encode(&data, line, sizeof(line)) > 0);
+        text += line;
+    }
+    QCOMPARE(parser.doParse(text.constData(), text.size()), 0);
+    QCOMPARE(c.records.size(), 10);
+    for (int i = 0; i < 10; i++){
+        const payloadData data = makePayload(i);
+        QCOMPARE(c.records[i].timerCounts, data.timerCounts);
+        QCOMPARE(c.records[i].kernelTime, data.kernelTime);
+        QCOMPARE(c.records[i].accuCounts, data.accuCounts);
+        QCOMPARE(c.records[i].wallNs, data.wallNs);
+        /* not part of the text line */
+        QCOMPARE(c.records[i].gateNs, 0LL);
+    }
+
+    /* too small a buffer */
+    const payloadData data = makePayload(1);
+    char small[20];
+    QCOMPARE(Parser::encode(&data, small, sizeof(small)), 0);
+}
+
+
+/* all fields survive Decoder::encode() and doDecode() */
+void
+TestHostware::binaryRoundTrip(){
+    Decoder decoder;
+    Collector c(&decoder);
+    sample_record_t stream[10];
+
+    for (int i = 0; i < 10; i++){
+        const payloadData data = makePayload(i);
+        Decoder::encode(&data, &stream[i]);
+    }
+    QCOMPARE(decoder.doDecode((const char *)stream, sizeof(stream)), 0);
+    QCOMPARE(c.records.size(), 10);
+    for (int i = 0; i < 10; i++){
+        const payloadData data = makePayload(i);
+        QCOMPARE(c.records[i].timerCounts, data.timerCounts);
+        QCOMPARE(c.records[i].kernelTime, data.kernelTime);
+        QCOMPARE(c.records[i].accuCounts, data.accuCounts);
+        QCOMPARE(c.records[i].gateNs, data.gateNs);
+        QCOMPARE(c.records[i].missedPeriods, data.missedPeriods);
+        QCOMPARE(c.records[i].saturatedChannels, data.saturatedChannels);
+        QCOMPARE(c.records[i].wallNs, data.wallNs);
+    }
+}
+
+
+/* line number and timer counts first, as the files saved by older
+   versions, then the other fields */
+void
+TestHostware::csvLine(){
+    const payloadData data = makePayload(2);
+    char line[192];
+
+    QVERIFY(Parser::encodeCsv(3, &data, line, sizeof(line)) > 0);
+    QCOMPARE(QByteArray(line),
+             QByteArray("3;2;2000;2147483645;999999939;2;0;1400000000000000002\n"));
+    /* the zero fields are there, too */
+    payloadData zero;
+    PayloadFields::clear(zero);
+    QVERIFY(Parser::encodeCsv(1, &zero, line, sizeof(line)) > 0);
+    QCOMPARE(QByteArray(line), QByteArray("1;0;0;0;0;0;0;0\n"));
+}
+
+
+void
+TestHostware::ringCopyLastN(){
+    SpscRing<int, 8> ring;
+    int in[20], out[20];
+
+    for (int i = 0; i < 20; i++)
+        in[i] = i;
+    QCOMPARE(ring.copyLastN(5, out), 0U);
+    ring.push(in, 3);
+    QCOMPARE(ring.copyLastN(5, out), 3U);
+    QCOMPARE(out[0], 0);
+    QCOMPARE(out[2], 2);
+    /* overwritten, capacity() of the newest are left */
+    ring.push(in + 3, 17);
+    QCOMPARE(ring.capacity(), 7U);
+    QCOMPARE(ring.copyLastN(20, out), 7U);
+    for (int i = 0; i < 7; i++)
+        QCOMPARE(out[i], 13 + i);
+    QCOMPARE(ring.copyLastN(2, out), 2U);
+    QCOMPARE(out[0], 18);
+    ring.reset();
+    QCOMPARE(ring.copyLastN(20, out), 0U);
+}
+
+
+void
+TestHostware::ringLost(){
+    SpscRing<int, 8> ring;
+    int in[20], out[20];
+
+    for (int i = 0; i < 20; i++)
+        in[i] = i;
+    ring.push(in, 5);
+    QCOMPARE(ring.pop(3, out), 3U);
+    QCOMPARE(out[0], 0);
+    QCOMPARE(ring.lost(), 0ULL);
+    /* 3 and 4 are still there, 5 .. 19 come. 7 fit */
+    ring.push(in + 5, 15);
+    QCOMPARE(ring.pop(20, out), 7U);
+    QCOMPARE(out[0], 13);
+    QCOMPARE(out[6], 19);
+    QCOMPARE(ring.lost(), 10ULL);
+    QCOMPARE(ring.pop(20, out), 0U);
+    /* copyLastN() does not remove */
+    ring.push(in, 2);
+    QCOMPARE(ring.copyLastN(20, out), 7U);
+    QCOMPARE(ring.pop(20, out), 2U);
+    QCOMPARE(ring.lost(), 10ULL);
+}
+
+
+/* producer and consumer on different threads. every element the
+   consumer gets must be intact and in order, the others are lost */
+void
+TestHostware::ringThreads(){
+    struct Elem { quint64 seq, check; };
+    static SpscRing<Elem, 64> ring;
+    const quint64 total = 7 * 300000;
+    std::atomic<bool> finished(false);
+    ring.reset();
+
+    std::thread producer([&](){
+        Elem buf[7];
+        for (quint64 k = 0; k < total; k += 7){
+            for (int i = 0; i < 7; i++){
+                buf[i].seq = k + i;
+                buf[i].check = ~(k + i);
+            }
+            ring.push(buf, 7);
+        }
+        finished.store(true);
+    });
+    Elem out[64];
+    quint64 popped = 0, bad = 0, last = 0;
+    bool stop = false;
+    while (!stop){
+        /* the elements pushed before finished are all there */
+        stop = finished.load();
+        unsigned int n;
+        while ((n = ring.pop(64, out)) > 0){
+            for (unsigned int i = 0; i < n; i++){
+                if ((out[i].check != ~out[i].seq) ||
+                    ((popped > 0) && (out[i].seq <= last)))
+                    bad++;
+                last = out[i].seq;
+                popped++;
+            }
+        }
+    }
+    producer.join();
+    QCOMPARE(bad, 0ULL);
+    QCOMPARE(last, total - 1);
+    QCOMPARE(popped + ring.lost(), total);
+}
+
+
+/* one sample per second (1 count) from startMs on */
+static void
+addSeconds(HistoryPyramid &history, qint64 startMs, int seconds){
+    payloadData batch[PAYLOAD_BATCH_MAX];
+
+    for (int done = 0; done < seconds; ){
+        const int n = qMin(seconds - done, PAYLOAD_BATCH_MAX);
+        for (int i = 0; i < n; i++){
+            PayloadFields::clear(batch[i]);
+            batch[i].kernelTime = startMs + 1000LL * (done + i);
+            batch[i].accuCounts = 1;
+            batch[i].gateNs = 1000000000LL;
+        }
+        history.add(batch, n, 0);
+        done += n;
+    }
+}
+
+
+/* a sample belongs to the slot of its end time, a slot covers
+   [startMs, startMs + width) */
+void
+TestHostware::historyBoundaries(){
+    HistoryPyramid history;
+    payloadData batch[4];
+    const qint64 times[4] = { 500, 1000, 1500, 2999 };
+    HistoryBucket buckets[10];
+
+    for (int i = 0; i < 4; i++){
+        PayloadFields::clear(batch[i]);
+        batch[i].kernelTime = times[i];
+        batch[i].accuCounts = i + 1;
+    }
+    /* the text format has no gate time, the nominal one is taken */
+    history.add(batch, 4, 500000000LL);
+
+    QCOMPARE(history.query(0, 2999, 10, buckets), 3);
+    QCOMPARE(buckets[0].startMs, 0LL);
+    QCOMPARE(buckets[0].counts, 1LL);
+    QCOMPARE(buckets[1].startMs, 1000LL);
+    QCOMPARE(buckets[1].counts, 5LL);
+    QCOMPARE(buckets[1].samples, 2);
+    QCOMPARE(buckets[1].liveNs, 1000000000LL);
+    QCOMPARE(buckets[1].meanCpm(), 300.0);
+    QCOMPARE(buckets[1].minCpm, 240.0);
+    QCOMPARE(buckets[1].maxCpm, 360.0);
+    QCOMPARE(buckets[2].startMs, 2000LL);
+    QCOMPARE(buckets[2].counts, 4LL);
+
+    /* the slot which ends at fromMs is not part of the range */
+    QCOMPARE(history.query(1000, 1999, 10, buckets), 1);
+    QCOMPARE(buckets[0].startMs, 1000LL);
+    QCOMPARE(history.query(999, 1000, 10, buckets), 2);
+    QCOMPARE(history.query(3000, 9999, 10, buckets), 0);
+
+    history.reset();
+    QCOMPARE(history.query(0, 2999, 10, buckets), 0);
+}
+
+
+/* a long range is folded into close to maxBuckets buckets of the
+   finest resolution which holds it */
+void
+TestHostware::historyFold(){
+    HistoryPyramid history;
+    HistoryBucket buckets[100];
+    const int days = 8;
+    const qint64 endMs = days * 86400000LL - 1000;
+
+    addSeconds(history, 0, days * 86400);
+
+    const qint64 spansMs[] = { 60000LL, 3600000LL, 86400000LL, 7 * 86400000LL };
+    for (unsigned int s = 0; s < sizeof(spansMs)/sizeof(spansMs[0]); s++){
+        const int n = history.query(endMs - spansMs[s], endMs, 100, buckets);
+        QVERIFY(n > 50);
+        QVERIFY(n <= 100);
+        qint64 counts = 0;
+        for (int i = 0; i < n; i++){
+            counts += buckets[i].counts;
+            QCOMPARE(buckets[i].meanCpm(), 60.0);
+            QCOMPARE(buckets[i].minCpm, 60.0);
+            QCOMPARE(buckets[i].maxCpm, 60.0);
+            if (i > 0)
+                QVERIFY(buckets[i].startMs > buckets[i - 1].startMs);
+            /* the buckets are aligned and of the same width, the oldest
+               one may start within */
+            if (i > 1)
+                QCOMPARE(buckets[i].startMs % (buckets[2].startMs - buckets[1].startMs),
+                         0LL);
+        }
+        /* the oldest slot (an hour at most) may start before the range,
+           the oldest bucket may be dropped */
+        QVERIFY(counts <= spansMs[s] / 1000 + 3600);
+        QVERIFY(counts >= spansMs[s] / 1000 * (n - 2) / n);
+        QCOMPARE(buckets[n - 1].startMs + buckets[n - 1].samples * 1000LL,
+                 endMs + 1000);
+    }
+}
+
+
+/* the fine resolutions forget, the coarse ones still hold the start */
+void
+TestHostware::historyBounded(){
+    HistoryPyramid history;
+    HistoryBucket buckets[100];
+
+    addSeconds(history, 0, 3 * 86400);
+    const int n = history.query(0, 3600000, 100, buckets);
+    QVERIFY(n >= 1);
+    QCOMPARE(buckets[0].startMs, 0LL);
+    QCOMPARE(buckets[0].counts, 3600LL);
+}
+
+
+QTEST_APPLESS_MAIN(TestHostware)
+
+#include "tst_hostware.moc"
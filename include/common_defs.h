@@ -23,6 +23,7 @@
 #ifndef COMMON_DEFS_H
 #define COMMON_DEFS_H
 
+#include <linux/types.h>
 #include <linux/ioctl.h>
 
 /** the character device name (location is /dev/) */
@@ -32,11 +33,355 @@
 /* [linux-3.12.23]$cat ./Documentation/ioctl/ioctl-number.txt */
 #define IOC_MAGIC 0xe0
 
+/** maximum number of counter inputs (gpio_pins module parameter) */
+#define MAX_CHANNELS 4
+
+/** the upper bits of a per pulse timestamp hold the channel */
+#define EVENT_CHANNEL_SHIFT 62
+#define EVENT_TIME_MASK ((1ULL << EVENT_CHANNEL_SHIFT) - 1)
+
+/** number of per pulse timestamps in the event ring of the firmware */
+/* must be a power of 2. at 30kHz the reader has to drain the ring
+   at least once a second, independent of the records */
+#define EVENT_RING_SIZE (1 << 15)
+
+/** argument of IOCTL_READ_EVENTS (drain the per pulse timestamps) */
+typedef struct {
+  /** user buffer of __u64 timestamps (pointer casted to __u64). bits
+      0..61 are ns, bits 62..63 are the channel */
+  __u64 buffer;
+  /** in: size of buffer in timestamps. out: timestamps copied */
+  __u32 count;
+  __u32 reserved;
+  /** out: pulses lost since start because the event ring was full */
+  __u64 overflows;
+} event_read_t;
+
+/** argument of IOCTL_GET_TIMEBASE */
+typedef struct {
+  /** timer period in ns */
+  __u64 period_ns;
+  /** timer events since start of measurement */
+  __u64 timer_events;
+  /** timer events which were missed because the timer callback ran
+      too late (hrtimer_forward() overruns). if this number grows the
+      period cannot be met */
+  __u64 missed_events;
+  /** 1 if the measurement is running. a reader which did not start it
+      gets -EBUSY from the ioctls which stop or reconfigure it */
+  __u32 running;
+  /** 0 */
+  __u32 reserved;
+} timebase_status_t;
+
+/** argument of IOCTL_GET_FIFO_STATS. records_written restarts with
+    IOCTL_START_MEASUREMENT, the other counters belong to the calling
+    reader and count since open(). records lost by a mmap() consumer
+    are not known to the firmware */
+typedef struct {
+  /** size of the record ring in records */
+  __u32 capacity;
+  /** records currently queued for this reader */
+  __u32 fill;
+  /** maximum number of records which were queued at a read() */
+  __u32 fill_hwm;
+  __u32 reserved;
+  /** records put into the ring */
+  __u64 records_written;
+  /** records this reader lost because it was too slow */
+  __u64 records_dropped;
+  /** size of the lost records in bytes */
+  __u64 bytes_dropped;
+} fifo_stats_t;
+
+/** argument of IOCTL_RUN_BENCHMARK. pulses are injected into channel 0
+    at a fixed rate and compared with what the counting path saw */
+typedef struct {
+  /** in: pulse rate in Hz (BENCH_RATE_MIN .. BENCH_RATE_MAX) */
+  __u64 rate_hz;
+  /** in: duration in ns (BENCH_DURATION_NS_MIN .. BENCH_DURATION_NS_MAX) */
+  __u64 duration_ns;
+  /** out: pulses injected */
+  __u64 generated;
+  /** out: pulses counted by channel 0. equals generated as long as the
+      rate is sustained (plus real pulses of the detector, if any) */
+  __u64 counted;
+} benchmark_t;
+
+/** inter-arrival time histogram, 4 bins per octave of ns. bins 0..3
+    hold 0..3 ns, bin b >= 4 holds the intervals from
+    (4 + b % 4) << (b / 4 - 1) ns up to the next bin. the last bin
+    also holds all longer intervals (> 30 min) */
+#define INTERVAL_HIST_BINS 160
+
+/** argument of IOCTL_GET_INTERVAL_HIST */
+typedef struct {
+  /** number of valid channels in bins */
+  __u32 channels;
+  __u32 reserved;
+  /** number of intervals between consecutive pulses of a channel */
+  __u32 bins[MAX_CHANNELS][INTERVAL_HIST_BINS];
+} interval_hist_t;
+
+/** unit of wakeup_t.watermark */
+enum WAKEUP_UNITS{
+  WAKEUP_RECORDS = 0,
+  /* converted to records with the output format of the file. a text
+     line is counted with its maximum length */
+  WAKEUP_BYTES = 1
+};
+
+/** argument of IOCTL_SET_WAKEUP. poll() and a blocking read() of this
+    file wait until watermark records are queued, the oldest queued
+    record is older than max_latency_ns or the measurement is stopped.
+    the latency is checked at every timer event. every open() starts
+    with a watermark of one record */
+typedef struct {
+  /** 0 is treated as 1. at most the size of the record ring */
+  __u32 watermark;
+  /** see enum WAKEUP_UNITS */
+  __u32 unit;
+  /** 0 = wait for the watermark only */
+  __u64 max_latency_ns;
+} wakeup_t;
+
+/** argument of IOCTL_GET_PULSE_STATS. both count since
+    IOCTL_START_MEASUREMENT. a hostware which sums up the accu_counts
+    it received finds the pulses lost on the way from the firmware */
+typedef struct {
+  /** pulses generated by the pulse simulator (TEST_ON_X86 builds,
+      0 otherwise). includes the pulses of the unfinished sample */
+  __u64 generated;
+  /** sum of accu_counts put into the record ring */
+  __u64 recorded;
+} pulse_stats_t;
+
+/** argument of IOCTL_GET_LIVE. the counts of the sample which is not
+    finished yet, e.g. for a display which is updated more often than
+    a sample is recorded */
+typedef struct {
+  /** ns since IOCTL_START_MEASUREMENT */
+  __u64 time_ns;
+  /** ns since the last sample boundary */
+  __u64 gate_elapsed_ns;
+  /** all counts since IOCTL_START_MEASUREMENT including the running
+      sample */
+  __u64 total_counts;
+  /** counts of the running sample (sum of all channels) */
+  __u32 accu_counts;
+  /** number of valid entries in channel_counts */
+  __u32 channels;
+  /** counts of the running sample per channel */
+  __u32 channel_counts[MAX_CHANNELS];
+  /** bit n is set if the interrupt of channel n is masked or was
+      masked within the running sample (see saturated_channels of the
+      records) */
+  __u32 saturated_channels;
+  /** 0 */
+  __u32 reserved;
+} live_snapshot_t;
+
+/** size of the burst capture in timestamps (pre_events + post_events) */
+#define CAPTURE_EVENTS_MAX 4096
+
+/** argument of IOCTL_SET_CAPTURE. the firmware keeps the last
+    pre_events pulse timestamps. as soon as the running sample holds more
+    than threshold counts the window is frozen and post_events timestamps
+    (starting with the triggering pulse) are added. a frozen capture is
+    fetched with IOCTL_READ_CAPTURE, which arms the trigger again */
+typedef struct {
+  /** counts of the running sample (all channels), 0 = off */
+  __u32 threshold;
+  /** timestamps before the triggering pulse */
+  __u32 pre_events;
+  /** timestamps from the triggering pulse on, at least 1 */
+  __u32 post_events;
+  __u32 reserved;
+} capture_config_t;
+
+/** argument of IOCTL_READ_CAPTURE. the timestamps have the format of
+    IOCTL_READ_EVENTS */
+typedef struct {
+  /** user buffer of __u64 timestamps (pointer casted to __u64) */
+  __u64 buffer;
+  /** in: size of buffer in timestamps. out: timestamps copied, 0 if
+      the trigger did not fire yet. the oldest ones are cut if the
+      buffer is too small */
+  __u32 count;
+  /** out: number of copied timestamps before the triggering pulse */
+  __u32 pre_events;
+  /** out: timestamp of the triggering pulse */
+  __u64 trigger_ns;
+  /** out: captures taken since IOCTL_SET_CAPTURE */
+  __u64 captures;
+} capture_read_t;
+
+/** absolute clock of sample_record_t.wall_ns (IOCTL_SET_WALL_CLOCK).
+    every open() of the device shares the setting */
+enum WALL_CLOCKS{
+  WALL_CLOCK_OFF = 0,
+  WALL_CLOCK_REALTIME = 1,
+  /* realtime without leap seconds, needs the tai offset set by ntpd
+     or ptp */
+  WALL_CLOCK_TAI = 2
+};
+
+/** argument of IOCTL_GET_CLOCK_OFFSETS, taken at
+    IOCTL_START_MEASUREMENT. an absolute time of a record is
+    start_monotonic_ns + time_ns + realtime_offset_ns, as long as the
+    wall clock is not stepped meanwhile */
+typedef struct {
+  /** CLOCK_MONOTONIC at the start, time_ns of the records is relative
+      to it */
+  __u64 start_monotonic_ns;
+  /** CLOCK_REALTIME - CLOCK_MONOTONIC */
+  __s64 realtime_offset_ns;
+  /** CLOCK_TAI - CLOCK_MONOTONIC */
+  __s64 tai_offset_ns;
+} clock_offsets_t;
+
 enum IOCTL_CMDS{
   IOCTL_GET_FIFO_LEN =  _IOR(IOC_MAGIC, 0, size_t),
   IOCTL_SET_TCNTSPERSAMPLE = _IOW(IOC_MAGIC, 1, unsigned int *),
   IOCTL_START_MEASUREMENT = _IO(IOC_MAGIC, 2),
-  IOCTL_STOP_MEASUREMENT = _IO(IOC_MAGIC, 3)
+  IOCTL_STOP_MEASUREMENT = _IO(IOC_MAGIC, 3),
+  IOCTL_SET_OUTPUT_FORMAT = _IOW(IOC_MAGIC, 4, unsigned int *),
+  IOCTL_SET_EVENT_MODE = _IOW(IOC_MAGIC, 5, unsigned int *),
+  IOCTL_READ_EVENTS = _IOWR(IOC_MAGIC, 6, event_read_t *),
+  IOCTL_SET_PERIOD_NS = _IOW(IOC_MAGIC, 7, __u64 *),
+  IOCTL_GET_TIMEBASE = _IOR(IOC_MAGIC, 8, timebase_status_t *),
+  IOCTL_GET_FIFO_STATS = _IOR(IOC_MAGIC, 9, fifo_stats_t *),
+  IOCTL_RUN_BENCHMARK = _IOWR(IOC_MAGIC, 10, benchmark_t *),
+  IOCTL_GET_INTERVAL_HIST = _IOR(IOC_MAGIC, 11, interval_hist_t *),
+  IOCTL_RESET_INTERVAL_HIST = _IO(IOC_MAGIC, 12),
+  IOCTL_SET_WAKEUP = _IOW(IOC_MAGIC, 13, wakeup_t *),
+  IOCTL_GET_PULSE_STATS = _IOR(IOC_MAGIC, 14, pulse_stats_t *),
+  IOCTL_GET_LIVE = _IOR(IOC_MAGIC, 15, live_snapshot_t *),
+  IOCTL_SET_PRESET_COUNTS = _IOW(IOC_MAGIC, 16, unsigned int *),
+  IOCTL_SET_CAPTURE = _IOW(IOC_MAGIC, 17, capture_config_t *),
+  IOCTL_READ_CAPTURE = _IOWR(IOC_MAGIC, 18, capture_read_t *),
+  IOCTL_SET_WALL_CLOCK = _IOW(IOC_MAGIC, 19, unsigned int *),
+  IOCTL_GET_CLOCK_OFFSETS = _IOR(IOC_MAGIC, 20, clock_offsets_t *)
+};
+
+/** limits of the timer period (IOCTL_SET_PERIOD_NS). a sample lasts
+    period_ns * timer counts per sample */
+#define PERIOD_NS_MIN (100ULL * 1000)
+#define PERIOD_NS_MAX (24ULL * 3600 * 1000000000)
+
+/** IOCTL_SET_PRESET_COUNTS: 0 selects preset time sampling (a record
+    every timer counts per sample periods). N > 0 emits a record as soon
+    as N pulses are counted. the record is emitted from a tasklet, its
+    gate ends when the counts are folded there. hence it holds N or a
+    few more pulses and gate_ns matches them, missed_periods is 0. the
+    sequence of such records counts the boundaries, not timer events.
+    N below PRESET_COUNTS_MIN is rejected (-EINVAL) before the
+    measurement is stopped: every boundary costs a tasklet */
+#define PRESET_COUNTS_MIN 100
+
+/** limits of IOCTL_RUN_BENCHMARK */
+#define BENCH_RATE_MIN 1ULL
+#define BENCH_RATE_MAX (10ULL * 1000 * 1000)
+#define BENCH_DURATION_NS_MIN (1ULL * 1000 * 1000)
+#define BENCH_DURATION_NS_MAX (10ULL * 1000000000)
+
+/** what read() delivers. every open() starts with OUTPUT_FORMAT_TEXT */
+enum OUTPUT_FORMATS{
+  /* one csv style line per sample "event/time/count: ; a ; b ; c\n".
+     with a wall clock the absolute ns follow as a fourth column */
+  OUTPUT_FORMAT_TEXT = 0,
+  /* a stream of sample_record_t. read() returns whole records only */
+  OUTPUT_FORMAT_BINARY = 1
 };
 
+/** layout version of sample_record_t. bump on every layout change */
+#define RECORD_VERSION 5
+
+/** binary sample record (host byte order)
+ *
+ * version and length come first so that a reader can reject or skip
+ * records of a layout it does not know. the __u64 fields sit on 8 byte
+ * offsets and the size is a multiple of 8, hence the records of the
+ * ring stay aligned although the struct is packed */
+typedef struct {
+  /** RECORD_VERSION */
+  __u16 version;
+  /** sizeof(sample_record_t) */
+  __u16 length;
+  /** geiger counts within the sample interval (sum of all channels) */
+  __u32 accu_counts;
+  /** timer event number which closed the sample (csv "event") */
+  __u64 sequence;
+  /** nanoseconds since IOCTL_START_MEASUREMENT (csv "time" is ms) */
+  __u64 time_ns;
+  /** number of valid entries in channel_counts */
+  __u32 channels;
+  /** pulses on two different channels within the coincidence window */
+  __u32 coincidence_counts;
+  /** geiger counts within the sample interval per channel */
+  __u32 channel_counts[MAX_CHANNELS];
+  /** measured length of the sample interval in ns, from the timer
+      event which opened it to the one which closed it. rates are
+      counts / gate_ns, the nominal period is off by the timer jitter */
+  __u64 gate_ns;
+  /** timer periods within the sample which were missed because the
+      timer callback ran too late. gate_ns includes them */
+  __u32 missed_periods;
+  /** edges within the dead time after a pulse (sum of all channels).
+      not part of the counts */
+  __u32 rejected_counts;
+  /** bit n is set if the interrupt of channel n was masked within the
+      sample because of an interrupt storm. its counts miss the edges
+      of the masked time, take them as a lower limit */
+  __u32 saturated_channels;
+  /** see enum WALL_CLOCKS */
+  __u32 wall_clock;
+  /** absolute ns of the wall clock at the sample boundary (time_ns),
+      0 if WALL_CLOCK_OFF */
+  __u64 wall_ns;
+} __attribute__((packed)) sample_record_t;
+
+/** layout version of ring_ctrl_t and reader_ctrl_t. bump on every
+    layout change */
+#define RING_VERSION 2
+
+/** the record ring shared via mmap()
+ *
+ * mmap() offset 0: reader_ctrl_t, one page per open file, may be mapped
+ *                  writable
+ * mmap() offset pagesize: ring_ctrl_t, one page, read only
+ * mmap() offset ring_ctrl_t.data_offset: the records, read only
+ *
+ * head and tail are free running 32 bit indices, record i is located
+ * at data[i & (capacity - 1)]. the ring is shared by all readers and
+ * the firmware never waits for a reader. if head - tail exceeds the
+ * capacity the reader was too slow and lost records. a record copied
+ * by the reader is valid only if head - i < capacity still holds
+ * after the copy */
+typedef struct {
+  /** RING_VERSION */
+  __u32 version;
+  /** sizeof(sample_record_t) */
+  __u32 record_size;
+  /** number of records, a power of 2 */
+  __u32 capacity;
+  /** mmap() offset of the first record, page aligned */
+  __u32 data_offset;
+  /** producer index, written by the firmware only */
+  __u32 head;
+} ring_ctrl_t;
+
+/** read cursor of one open file (see ring_ctrl_t). read() and a mmap()
+ *  consumer share it. the firmware takes head - tail as the records
+ *  which are still queued: poll(), a blocking read() and the wakeups
+ *  (watermark and latency, see IOCTL_SET_WAKEUP) wait for them, the
+ *  fill statistics count them. a mmap() consumer has to advance tail
+ *  after every copy, otherwise it is woken up for records it has seen
+ *  already and never sleeps */
+typedef struct {
+  /** consumer index, advanced by the reader (release order after the
+      records are copied) */
+  __u32 tail;
+} reader_ctrl_t;
+
 #endif